@@ -2,8 +2,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "concurrent_list.h"
 
+#define SHARED_LIST_MAGIC 0x4c495354 /* written last by create_shared_list, attach_shared_list checks it */
+#define SHARED_NONE (-1) /* the end of a chain of node indexes */
+
 /* node struct that contains 3 fields
 node's value, epointer to the next node, lock of the node */
 struct node {
@@ -12,11 +20,32 @@ struct node {
     pthread_mutex_t lock; /* node's lock */
 };
 
-/* list struct that contains 2 fields
-pointer to the head of the list, lock of the list */
+/* node of a shared list, it lives in the node arena of the shared segment that every process maps
+at a different address, so it links to the next node by its index in the arena and not by a pointer */
+struct shared_node {
+    int value; /* node value */
+    int next; /* index of the next node or SHARED_NONE */
+    pthread_mutex_t lock; /* node's lock (robust and process shared) */
+};
+
+/* the shared segment: the list header, the free nodes and the node arena */
+struct shared_list {
+    int magic; /* SHARED_LIST_MAGIC once the segment is ready */
+    int capacity; /* nodes in the arena */
+    int head; /* index of the first node or SHARED_NONE */
+    int free; /* index of the first free node or SHARED_NONE, the free nodes are chained by 'next' */
+    pthread_mutex_t lock; /* protects head, like the lock of a list */
+    pthread_mutex_t free_lock; /* protects free */
+    struct shared_node nodes[]; /* the arena */
+};
+
+/* list struct that contains 4 fields
+pointer to the head of the list, lock of the list, and for a shared list its mapping */
 struct list {
   struct node* head; /* list head pointer */
   pthread_mutex_t lock; /* list lock */
+  struct shared_list* shared; /* the mapped segment of a shared list, NULL for a list of this process */
+  size_t shared_size; /* bytes of the mapping */
 };
 
 /* function that creating a new node by allocating memory to the new node
@@ -59,6 +88,7 @@ list* create_list()
       exit(1);
   }
   new_list->head = NULL; /* head of the list pointing on NULL */
+  new_list->shared = NULL; /* a list of this process */
   if(pthread_mutex_init(&(new_list->lock),NULL) != 0) /* initializing the lock of the list */
   {
       free(new_list); 
@@ -68,6 +98,298 @@ list* create_list()
   return new_list; /* return the pointer to the new list */
 }
 
+/* locking a lock of a shared list, if the process that held it died the lock is taken over, the lists change
+their links with single stores so the list is still whole (at most the node that the dead process was
+inserting or removing is lost from the arena) */
+void shared_lock(pthread_mutex_t* lock)
+{
+    if(pthread_mutex_lock(lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(lock);
+    }
+}
+
+/* initializing a lock that every process that maps the segment can use */
+int shared_lock_init(pthread_mutex_t* lock)
+{
+    pthread_mutexattr_t attr;
+    int result;
+    if(pthread_mutexattr_init(&attr) != 0)
+    {
+        return -1;
+    }
+    result = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) | pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) |
+             pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return (result == 0) ? 0 : -1;
+}
+
+/* function that creating a shared list in a new shared memory segment named 'name' (like "/my_list") with
+room for 'capacity' nodes, the function returns a pointer to the list of this process or NULL (with errno)
+if the segment could not be created, other processes use the list with attach_shared_list */
+list* create_shared_list(const char* name, int capacity)
+{
+    struct list* new_list;
+    struct shared_list* shared;
+    size_t size = sizeof(struct shared_list) + (size_t)capacity * sizeof(struct shared_node);
+    int fd;
+    int i;
+    if(capacity <= 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600); /* O_EXCL so only one process initializes it */
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    if(ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    new_list = (struct list*)malloc(sizeof(struct list));
+    if(shared == MAP_FAILED || new_list == NULL)
+    {
+        if(shared != MAP_FAILED)
+        {
+            munmap(shared, size);
+        }
+        free(new_list);
+        shm_unlink(name);
+        errno = ENOMEM;
+        return NULL;
+    }
+    shared->capacity = capacity;
+    shared->head = SHARED_NONE;
+    shared->free = 0;
+    for(i = 0; i < capacity; i++) /* every node is free */
+    {
+        shared->nodes[i].next = (i + 1 < capacity) ? i + 1 : SHARED_NONE;
+        if(shared_lock_init(&shared->nodes[i].lock) != 0)
+        {
+            break;
+        }
+    }
+    if(i < capacity || shared_lock_init(&shared->lock) != 0 || shared_lock_init(&shared->free_lock) != 0)
+    {
+        munmap(shared, size);
+        free(new_list);
+        shm_unlink(name);
+        errno = ENOMEM;
+        return NULL;
+    }
+    __sync_synchronize(); /* the segment is ready before the magic says so */
+    shared->magic = SHARED_LIST_MAGIC;
+    new_list->head = NULL;
+    new_list->shared = shared;
+    new_list->shared_size = size;
+    return new_list;
+}
+
+/* function that mapping the shared list that was created with the received name, the function returns a pointer
+to the list of this process or NULL (with errno) if there is no such list */
+list* attach_shared_list(const char* name)
+{
+    struct list* new_list;
+    struct shared_list* shared;
+    struct stat st;
+    int fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shared_list))
+    {
+        close(fd);
+        errno = EINVAL; /* not created yet */
+        return NULL;
+    }
+    shared = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shared == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if(shared->magic != SHARED_LIST_MAGIC ||
+       (size_t)st.st_size < sizeof(struct shared_list) + (size_t)shared->capacity * sizeof(struct shared_node))
+    {
+        munmap(shared, st.st_size);
+        errno = EINVAL; /* not initialized yet or not a list */
+        return NULL;
+    }
+    __sync_synchronize(); /* reading the segment after the magic */
+    new_list = (struct list*)malloc(sizeof(struct list));
+    if(new_list == NULL)
+    {
+        munmap(shared, st.st_size);
+        return NULL;
+    }
+    new_list->head = NULL;
+    new_list->shared = shared;
+    new_list->shared_size = st.st_size;
+    return new_list;
+}
+
+/* function that removing the name of a shared list, the processes that attached it keep using it till they delete their list */
+int remove_shared_list(const char* name)
+{
+    return shm_unlink(name);
+}
+
+/* taking a node from the free nodes of a shared list, returns its index or SHARED_NONE if the arena is full */
+int shared_alloc_node(struct shared_list* shared)
+{
+    int index;
+    shared_lock(&shared->free_lock);
+    index = shared->free;
+    if(index != SHARED_NONE)
+    {
+        shared->free = shared->nodes[index].next;
+    }
+    pthread_mutex_unlock(&shared->free_lock);
+    return index;
+}
+
+/* giving a node that no other node links to back to the free nodes */
+void shared_free_node(struct shared_list* shared, int index)
+{
+    shared_lock(&shared->free_lock);
+    shared->nodes[index].next = shared->free;
+    shared->free = index;
+    pthread_mutex_unlock(&shared->free_lock);
+}
+
+/* insert_value of a shared list, the same hand over hand locking with indexes instead of pointers */
+void shared_insert_value(list* list, int value)
+{
+    struct shared_list* shared = list->shared;
+    struct shared_node* nodes = shared->nodes;
+    int index = shared_alloc_node(shared);
+    int current;
+    int next;
+    if(index == SHARED_NONE) /* the arena is full */
+    {
+        delete_list(list);
+        errno = ENOSPC;
+        perror("error");
+        exit(1);
+    }
+    nodes[index].value = value;
+    shared_lock(&shared->lock); /* locking the list */
+    if(shared->head == SHARED_NONE || nodes[shared->head].value > value) /* the new node is the first node */
+    {
+        nodes[index].next = shared->head;
+        shared->head = index; /* (one store links the node) */
+        pthread_mutex_unlock(&shared->lock);
+        return;
+    }
+    current = shared->head;
+    shared_lock(&nodes[current].lock); /* locking the head node */
+    pthread_mutex_unlock(&shared->lock);
+    while((next = nodes[current].next) != SHARED_NONE && nodes[next].value < value) /* moving forward */
+    {
+        shared_lock(&nodes[next].lock);
+        pthread_mutex_unlock(&nodes[current].lock);
+        current = next;
+    }
+    nodes[index].next = next;
+    nodes[current].next = index; /* (one store links the node) */
+    pthread_mutex_unlock(&nodes[current].lock);
+}
+
+/* remove_value of a shared list, the removed node is locked before it is unlinked so no process is still on it
+when it goes back to the free nodes */
+void shared_remove_value(list* list, int value)
+{
+    struct shared_list* shared = list->shared;
+    struct shared_node* nodes = shared->nodes;
+    int current;
+    int next;
+    shared_lock(&shared->lock); /* locking the list */
+    current = shared->head;
+    if(current == SHARED_NONE)
+    {
+        pthread_mutex_unlock(&shared->lock);
+        return;
+    }
+    shared_lock(&nodes[current].lock);
+    if(nodes[current].value == value) /* removing the head, the list stays locked while head changes */
+    {
+        shared->head = nodes[current].next;
+        pthread_mutex_unlock(&nodes[current].lock);
+        pthread_mutex_unlock(&shared->lock);
+        shared_free_node(shared, current);
+        return;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    while((next = nodes[current].next) != SHARED_NONE && nodes[next].value < value) /* moving forward */
+    {
+        shared_lock(&nodes[next].lock);
+        pthread_mutex_unlock(&nodes[current].lock);
+        current = next;
+    }
+    if(next != SHARED_NONE && nodes[next].value == value)
+    {
+        shared_lock(&nodes[next].lock); /* waiting for a process that is still on the node */
+        nodes[current].next = nodes[next].next; /* (one store unlinks the node) */
+        pthread_mutex_unlock(&nodes[next].lock);
+        shared_free_node(shared, next);
+    }
+    pthread_mutex_unlock(&nodes[current].lock);
+}
+
+/* calling 'visit' with the value of every node of a shared list from smaller to greater, hand over hand */
+void shared_walk(list* list, void (*visit)(int value, void* arg), void* arg)
+{
+    struct shared_list* shared = list->shared;
+    struct shared_node* nodes = shared->nodes;
+    int current;
+    int next;
+    shared_lock(&shared->lock);
+    current = shared->head;
+    if(current != SHARED_NONE)
+    {
+        shared_lock(&nodes[current].lock);
+    }
+    pthread_mutex_unlock(&shared->lock);
+    while(current != SHARED_NONE)
+    {
+        visit(nodes[current].value, arg);
+        next = nodes[current].next;
+        if(next != SHARED_NONE)
+        {
+            shared_lock(&nodes[next].lock);
+        }
+        pthread_mutex_unlock(&nodes[current].lock);
+        current = next;
+    }
+}
+
+void shared_print_value(int value, void* arg)
+{
+    printf("%d ", value);
+}
+
+/* the state of count_list on a shared list */
+struct shared_count {
+    int (*predicate)(int);
+    int count;
+};
+
+void shared_count_value(int value, void* arg)
+{
+    struct shared_count* counter = (struct shared_count*)arg;
+    if(counter->predicate(value))
+    {
+        counter->count++;
+    }
+}
+
 /* function that deleting the received list by removing all the nodes and removing the list after that */
 void delete_list(list* list)
 {
@@ -75,6 +397,12 @@ void delete_list(list* list)
     {
         return;
     }
+    if(list->shared != NULL) /* the nodes belong to every process of the list, only this process's mapping is removed */
+    {
+        munmap(list->shared, list->shared_size);
+        free(list);
+        return;
+    }
     pthread_mutex_lock(&(list->lock)); /* locking the list to guarantee the head node */
     
     node* current = list->head; /* current points to the head of the list */
@@ -106,7 +434,11 @@ void delete_list(list* list)
 void insert_value(list* list, int value)
 {        
     // add code here
-    if(list != NULL)
+    if(list != NULL && list->shared != NULL)
+    {
+        shared_insert_value(list, value);
+    }
+    else if(list != NULL)
     {
         node* new_node = create_node(value); /* creating the new node to insert it */
         if(new_node == NULL)
@@ -149,7 +481,11 @@ void insert_value(list* list, int value)
 
 void remove_value(list* list, int value)
 {
-    if(list != NULL)
+    if(list != NULL && list->shared != NULL)
+    {
+        shared_remove_value(list, value);
+    }
+    else if(list != NULL)
     {
         pthread_mutex_lock(&(list->lock)); /* lock the list */
         node* current;
@@ -197,7 +533,11 @@ void print_list(list* list)
 {
   // add code here
   struct node* current; 
-  if(list != NULL) 
+  if(list != NULL && list->shared != NULL)
+  {
+      shared_walk(list, shared_print_value, NULL);
+  }
+  else if(list != NULL) 
   {
       pthread_mutex_lock(&(list->lock)); /* locking the list to lock the head if exists */
       current = list->head; /* to start printing from the head */
@@ -228,7 +568,15 @@ void count_list(list* list, int (*predicate)(int))
 
   // add code here
   struct node* current = NULL; /* the node we want to use for current node (initializing it to NULL for preventing it to be garbage value (when head = NULL and it reaches while loop)) */
-  if(list != NULL)
+  struct shared_count counter; /* for a shared list */
+  if(list != NULL && list->shared != NULL)
+  {
+      counter.predicate = predicate;
+      counter.count = 0;
+      shared_walk(list, shared_count_value, &counter);
+      count = counter.count;
+  }
+  else if(list != NULL)
   {
       pthread_mutex_lock(&(list->lock)); /* locking the list to lock the head if exists */
       if(list->head != NULL)
@@ -2,6 +2,11 @@ typedef struct node node;
 typedef struct list list;
 
 list* create_list();
+/* a list in the shared memory segment 'name' that every process that attaches it can use with the functions
+below, delete_list only detaches it, NULL (with errno) on failure */
+list* create_shared_list(const char* name, int capacity);
+list* attach_shared_list(const char* name);
+int remove_shared_list(const char* name);
 void delete_list(list* list);
 void print_list(list* list);
 void insert_value(list* list, int value);
@@ -12,6 +12,7 @@
 
 #define CMD_BUFFER_SIZE 100
 #define MAX_THREAD_COUNT 252
+#define SHARED_LIST_NAME "/concurrent_list_test"
 
 char* delimiters = " \n\r\t";
 char* string_delimiter = "\"";
@@ -85,6 +86,26 @@ int execute_command(char* command, int value)
 	{
 		mylist = create_list();
 	}
+	else if(strcmp(command, "create_shared_list") == 0) /* create_shared_list <capacity> */
+	{
+		mylist = create_shared_list(SHARED_LIST_NAME, value);
+		if(mylist == NULL)
+		{
+			perror("create_shared_list");
+		}
+	}
+	else if(strcmp(command, "attach_shared_list") == 0) /* the list of another test process */
+	{
+		mylist = attach_shared_list(SHARED_LIST_NAME);
+		if(mylist == NULL)
+		{
+			perror("attach_shared_list");
+		}
+	}
+	else if(strcmp(command, "remove_shared_list") == 0)
+	{
+		remove_shared_list(SHARED_LIST_NAME);
+	}
 	else if(strcmp(command, "delete_list") == 0)
 	{
 		pthread_create(&threads[thread_count], NULL, delete_list_task, NULL);
@@ -7,14 +7,35 @@
 #include <linux/errno.h>  
 #include <linux/types.h> 
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/fcntl.h>
 #include <asm/system.h>
 #include <asm/uaccess.h>
 #include <linux/string.h>
+#include <linux/rwsem.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/cache.h>
+#include <linux/smp.h>
+#include <linux/sched.h>
+#include <asm/timex.h>
+#include <asm/semaphore.h>
 
 #include "encdec.h"
+#include "encdec_cipher.h"
 
 #define MODULE_NAME "encdec"
+#define ENCDEC_CHUNK_SIZE 512 /* bytes that are ciphered on the stack around every copy_to_user and copy_from_user */
+#define ENCDEC_LOCK_SHARDS 16 /* number of regions of a device buffer that are locked separately */
+#define ENCDEC_LATENCY_BUCKETS 32 /* bucket i counts the requests that took [2^i, 2^(i+1)) cycles */
+#define ENCDEC_IOCTL_COUNTED 10 /* the ioctl commands 0..8 are counted one by one and the unknown ones as the last */
+#define ENCDEC_PROC_NAME "encdec"
+#define ENCDEC_MAX_DEVICES 64 /* the most minors that device_count can ask for */
+#define ENCDEC_CIPHER_CAESAR 0
+#define ENCDEC_CIPHER_XOR 1
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("SHARBEL_OBAIDA");
@@ -29,21 +50,76 @@ ssize_t encdec_write_caesar(struct file *filp, const char *buf, size_t count, lo
 ssize_t encdec_read_xor( struct file *filp, char *buf, size_t count, loff_t *f_pos );
 ssize_t encdec_write_xor(struct file *filp, const char *buf, size_t count, loff_t *f_pos);
 
+/* scatter/gather, each call locks its whole range once */
+ssize_t encdec_readv_caesar(struct file *filp, const struct iovec *iov, unsigned long nr_segs, loff_t *f_pos);
+ssize_t encdec_writev_caesar(struct file *filp, const struct iovec *iov, unsigned long nr_segs, loff_t *f_pos);
+ssize_t encdec_readv_xor(struct file *filp, const struct iovec *iov, unsigned long nr_segs, loff_t *f_pos);
+ssize_t encdec_writev_xor(struct file *filp, const struct iovec *iov, unsigned long nr_segs, loff_t *f_pos);
+
+loff_t	encdec_llseek(struct file *filp, loff_t offset, int whence);
+unsigned int encdec_poll(struct file *filp, poll_table *wait);
+
+int 	encdec_mmap(struct file *filp, struct vm_area_struct *vma);
+
 int memory_size = 0;
+int device_count = 2; /* minors 0 .. device_count - 1 */
+char* device_ciphers[ENCDEC_MAX_DEVICES]; /* "caesar" or "xor" by minor, by default even minors are caesar and odd are xor */
 
 MODULE_PARM(memory_size, "i");
+MODULE_PARM(device_count, "i");
+MODULE_PARM(device_ciphers, "1-" __MODULE_STRING(ENCDEC_MAX_DEVICES) "s");
 
 int major = 0;
-char* caesar_cipher_buff;
-char* xor_buff;
+/* the counters of a device on one cpu, every cpu updates only its own copy (in its own cache line) so the
+counters cost no atomic operations and no cache line bouncing, /proc/encdec sums the copies */
+typedef struct {
+	unsigned long bytes_read[2]; /* by mode (ENCDEC_MODE_RANDOM_ACCESS, ENCDEC_MODE_STREAM) */
+	unsigned long bytes_written[2];
+	unsigned long short_reads; /* requests that moved fewer bytes than asked */
+	unsigned long short_writes;
+	unsigned long faults; /* requests that failed with -EFAULT */
+	unsigned long ioctls[ENCDEC_IOCTL_COUNTED]; /* by command */
+	unsigned long cycles[ENCDEC_LATENCY_BUCKETS]; /* the time of the read and write requests */
+} ____cacheline_aligned encdec_cpu_stats;
+
+/* a device buffer and the locks of its regions, region i is [i * region_size, (i + 1) * region_size)
+readers of a region share its lock and writers take it alone, so only accesses to the same regions wait for each other.
+the buffer is made of single pages (not one kmalloc) so its pages can be mapped to user space, a page is allocated
+only when it is first written (or mapped), till then it reads as zeros, so the memory follows the written data */
+typedef struct {
+	int cipher; /* ENCDEC_CIPHER_CAESAR or ENCDEC_CIPHER_XOR */
+	struct page** pages; /* NULL for pages that were never written */
+	unsigned long nr_pages;
+	spinlock_t page_lock; /* protects installing and removing pages */
+	int region_size; /* (a multiple of PAGE_SIZE so every page is in one region) */
+	struct rw_semaphore locks[ENCDEC_LOCK_SHARDS];
+	/* the ring of ENCDEC_MODE_STREAM, the bytes [stream_tail, stream_head) (mod memory_size) were written and
+	not read yet, the producer only moves the head and the consumer only moves the tail so they do not lock
+	each other, the semaphores keep one producer and one consumer at a time */
+	unsigned long stream_head;
+	unsigned long stream_tail;
+	struct semaphore stream_producer;
+	struct semaphore stream_consumer;
+	wait_queue_head_t stream_readable; /* woken when the head moves */
+	wait_queue_head_t stream_writable; /* woken when the tail moves */
+	encdec_cpu_stats stats[NR_CPUS]; /* by smp_processor_id() */
+} encdec_device;
+
+/* the device of every minor, each one is allocated alone so devices share no memory and no cache lines */
+encdec_device* encdec_devices[ENCDEC_MAX_DEVICES];
+char* encdec_zero_page; /* the bytes of the pages that were never written */
 
 struct file_operations fops_caesar = {
 	.open 	 =	encdec_open,
 	.release =	encdec_release,
 	.read 	 =	encdec_read_caesar,
 	.write 	 =	encdec_write_caesar,
-	.llseek  =	NULL,
+	.readv 	 =	encdec_readv_caesar,
+	.writev  =	encdec_writev_caesar,
+	.llseek  =	encdec_llseek,
+	.poll 	 =	encdec_poll,
 	.ioctl 	 =	encdec_ioctl,
+	.mmap 	 =	encdec_mmap,
 	.owner 	 =	THIS_MODULE
 };
 
@@ -52,8 +128,12 @@ struct file_operations fops_xor = {
 	.release =	encdec_release,
 	.read 	 =	encdec_read_xor,
 	.write 	 =	encdec_write_xor,
-	.llseek  =	NULL,
+	.readv 	 =	encdec_readv_xor,
+	.writev  =	encdec_writev_xor,
+	.llseek  =	encdec_llseek,
+	.poll 	 =	encdec_poll,
 	.ioctl 	 =	encdec_ioctl,
+	.mmap 	 =	encdec_mmap,
 	.owner 	 =	THIS_MODULE
 };
 
@@ -63,39 +143,358 @@ struct file_operations fops_xor = {
 typedef struct {
 	unsigned char key;
 	int read_state;
+	int mode; /* ENCDEC_MODE_RANDOM_ACCESS or ENCDEC_MODE_STREAM */
+	encdec_device* dev; /* the device that was opened */
+	size_t keystream_length; /* bytes of the multi-byte xor key, 0 when 'key' is used */
+	size_t keystream_stride; /* see encdec_expand_key */
+	unsigned char keystream[ENCDEC_KEY_BLOCK_SIZE(ENCDEC_KEYSTREAM_MAX)]; /* the expanded multi-byte key */
 } encdec_private_date;
 
+/* the ciphers work on whole words, see encdec_cipher.h */
 void caesar_encrypt(char* s, size_t amount, unsigned int key)
 {   
+    encdec_caesar(s, s, amount, key); /* caesar encryption */
+}
+
+void caesar_decrypt(char* s, size_t amount, unsigned int key)
+{    
+    encdec_caesar(s, s, amount, encdec_caesar_inverse(key)); /* caesar decryption */
+}
+
+void xor_encrypt_decrypt(char* s, size_t amount, unsigned int key)
+{
+    encdec_xor(s, s, amount, key); /* xor encryption/decryption */
+}
+
+/* encrypting from src to dst without changing src */
+void caesar_encrypt_copy(char* dst, const char* src, size_t amount, unsigned char key)
+{
+    encdec_caesar(dst, src, amount, key);
+}
+
+/* decrypting from src to dst without changing src */
+void caesar_decrypt_copy(char* dst, const char* src, size_t amount, unsigned char key)
+{
+    encdec_caesar(dst, src, amount, encdec_caesar_inverse(key));
+}
+
+void xor_encrypt_copy(char* dst, const char* src, size_t amount, unsigned char key)
+{
+    encdec_xor(dst, src, amount, key);
+}
+
+void xor_decrypt_copy(char* dst, const char* src, size_t amount, unsigned char key)
+{
+    encdec_xor(dst, src, amount, key);
+}
+
+/* copying 'count' decrypted bytes of the device buffer to the user buffer, the bytes are decrypted chunk by
+chunk into a bounce buffer on the stack so the device buffer itself is only read (concurrent readers see
+the cipher text as is), returns 0 or -EFAULT */
+int encdec_copy_decrypted(char* buf, const char* src, size_t count, unsigned char key,
+                          void (*decrypt)(char* dst, const char* src, size_t amount, unsigned char key))
+{
+    char bounce[ENCDEC_CHUNK_SIZE];
+    size_t chunk;
+    while(count > 0)
+    {
+        chunk = (count < ENCDEC_CHUNK_SIZE) ? count : ENCDEC_CHUNK_SIZE;
+        decrypt(bounce, src, chunk, key);
+        if(copy_to_user(buf, bounce, chunk))
+        {
+            return -EFAULT;
+        }
+        buf += chunk;
+        src += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+/* as encdec_copy_decrypted for a multi-byte xor key, 'pos' is the offset of src in the device buffer */
+int encdec_copy_keystream(char* buf, const char* src, size_t count, unsigned long pos, encdec_private_date* pd)
+{
+    char bounce[ENCDEC_CHUNK_SIZE];
+    size_t chunk;
+    while(count > 0)
+    {
+        chunk = (count < ENCDEC_CHUNK_SIZE) ? count : ENCDEC_CHUNK_SIZE;
+        encdec_xor_key(bounce, src, chunk, pos, pd->keystream, pd->keystream_length, pd->keystream_stride);
+        if(copy_to_user(buf, bounce, chunk))
+        {
+            return -EFAULT;
+        }
+        buf += chunk;
+        src += chunk;
+        pos += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+/* initializing the locks of the received device */
+void encdec_init_device(encdec_device* dev)
+{
     int i;
-    int amount2 = (int)amount; /* the amout of the chars to encrypt */
-    for(i = 0; i < amount2; i++) /* encrypting the required chars */
+    dev->region_size = (memory_size + ENCDEC_LOCK_SHARDS - 1) / ENCDEC_LOCK_SHARDS;
+    dev->region_size = (dev->region_size + PAGE_SIZE - 1) & PAGE_MASK; /* whole pages */
+    if(dev->region_size == 0)
+    {
+        dev->region_size = PAGE_SIZE;
+    }
+    spin_lock_init(&dev->page_lock);
+    for(i = 0; i < ENCDEC_LOCK_SHARDS; i++)
     {
-        s[i] = (s[i] + key) % 128; /* caesar encryption */
+        init_rwsem(&dev->locks[i]);
     }
+    dev->stream_head = 0;
+    dev->stream_tail = 0;
+    init_MUTEX(&dev->stream_producer);
+    init_MUTEX(&dev->stream_consumer);
+    init_waitqueue_head(&dev->stream_readable);
+    init_waitqueue_head(&dev->stream_writable);
 }
 
-void caesar_decrypt(char* s, size_t amount, unsigned int key)
-{    
+/* locking the regions of the device that [pos, pos + count) touches (count > 0), always from the
+first region to the last one so two accesses can not wait for each other in a cycle */
+void encdec_lock_range(encdec_device* dev, loff_t pos, size_t count, int write)
+{
+    int first = (int)pos / dev->region_size;
+    int last = (int)(pos + count - 1) / dev->region_size;
     int i;
-    int amount2 = (int)amount; /* the amout of the chars to encrypt */
-    for(i = 0; i < amount2; i++) /* decrypting the required chars */
+    for(i = first; i <= last; i++)
     {
-        s[i] = ((s[i] - key) + 128) % 128; /* caesar decryption */
+        if(write)
+        {
+            down_write(&dev->locks[i]);
+        }
+        else
+        {
+            down_read(&dev->locks[i]);
+        }
     }
 }
 
-void xor_encrypt_decrypt(char* s, size_t amount, unsigned int key)
+void encdec_unlock_range(encdec_device* dev, loff_t pos, size_t count, int write)
+{
+    int first = (int)pos / dev->region_size;
+    int last = (int)(pos + count - 1) / dev->region_size;
+    int i;
+    for(i = last; i >= first; i--)
+    {
+        if(write)
+        {
+            up_write(&dev->locks[i]);
+        }
+        else
+        {
+            up_read(&dev->locks[i]);
+        }
+    }
+}
+
+/* allocating a device with the given cipher and its page table, returns NULL if there is no memory */
+encdec_device* encdec_create_device(int cipher)
+{
+    encdec_device* dev = vmalloc(sizeof(encdec_device)); /* (the per-cpu counters make it too large for kmalloc) */
+    if(dev == NULL)
+    {
+        return NULL;
+    }
+    memset(dev, 0, sizeof(encdec_device));
+    dev->cipher = cipher;
+    dev->nr_pages = ((unsigned long)memory_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    dev->pages = vmalloc(dev->nr_pages * sizeof(struct page*) + 1); /* (too large for kmalloc on huge devices, +1 so an empty device is not a NULL) */
+    if(dev->pages == NULL)
+    {
+        vfree(dev);
+        return NULL;
+    }
+    memset(dev->pages, 0, dev->nr_pages * sizeof(struct page*));
+    encdec_init_device(dev);
+    return dev;
+}
+
+/* freeing the pages of the received device buffer (pages that are still mapped are freed by their last user) */
+void encdec_free_device(encdec_device* dev)
+{
+    unsigned long i;
+    if(dev == NULL)
+    {
+        return;
+    }
+    for(i = 0; i < dev->nr_pages; i++)
+    {
+        if(dev->pages[i] != NULL)
+        {
+            __free_page(dev->pages[i]);
+        }
+    }
+    vfree(dev->pages);
+    vfree(dev);
+}
+
+/* returns the page at index of the device buffer, a zeroed page is allocated on its first use, returns NULL if there is no memory */
+struct page* encdec_get_page(encdec_device* dev, unsigned long index)
+{
+    struct page* installed;
+    struct page* page = dev->pages[index];
+    if(page != NULL)
+    {
+        return page;
+    }
+    page = alloc_page(GFP_KERNEL); /* (may sleep, so not under the spinlock) */
+    if(page == NULL)
+    {
+        return NULL;
+    }
+    memset(page_address(page), 0, PAGE_SIZE);
+    spin_lock(&dev->page_lock);
+    if(dev->pages[index] == NULL)
+    {
+        dev->pages[index] = page;
+        page = NULL;
+    }
+    installed = dev->pages[index];
+    spin_unlock(&dev->page_lock);
+    if(page != NULL) /* a mapping of the page has installed it before us */
+    {
+        __free_page(page);
+    }
+    return installed;
+}
+
+/* returns the kernel address of the byte at pos in the device buffer for reading (a page that was never written is read from the zero page) */
+char* encdec_addr(encdec_device* dev, loff_t pos)
+{
+    struct page* page = dev->pages[pos >> PAGE_SHIFT];
+    return ((page != NULL) ? (char*)page_address(page) : encdec_zero_page) + (pos & (PAGE_SIZE - 1));
+}
+
+/* returns the kernel address of the byte at pos in the device buffer for writing (the page is allocated if needed) or NULL if there is no memory */
+char* encdec_write_addr(encdec_device* dev, loff_t pos)
 {
+    struct page* page = encdec_get_page(dev, pos >> PAGE_SHIFT);
+    return (page != NULL) ? (char*)page_address(page) + (pos & (PAGE_SIZE - 1)) : NULL;
+}
+
+/* returns how many of the count bytes that start at pos are in the page of pos */
+size_t encdec_segment(loff_t pos, size_t count)
+{
+    size_t left = PAGE_SIZE - (pos & (PAGE_SIZE - 1));
+    return (count < left) ? count : left;
+}
+
+/* writing the sums of the per-cpu counters of a device to /proc/encdec */
+void encdec_proc_device(struct seq_file *m, int minor, encdec_device* dev)
+{
+    static const char* ioctl_names[ENCDEC_IOCTL_COUNTED] = {
+        "change_key", "set_read_state", "zero", "discard", "transform", "batch", "set_mode", "reset_stats",
+        "set_keystream", "other"
+    };
+    encdec_cpu_stats sum;
+    int cpu;
     int i;
-    int amount2 = (int)amount; /* the amout of the chars to encrypt */
-    for(i = 0; i < amount2; i++) /* encrypting/decrypting the required chars */
+    memset(&sum, 0, sizeof(sum));
+    for(cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        for(i = 0; i < 2; i++)
+        {
+            sum.bytes_read[i] += dev->stats[cpu].bytes_read[i];
+            sum.bytes_written[i] += dev->stats[cpu].bytes_written[i];
+        }
+        sum.short_reads += dev->stats[cpu].short_reads;
+        sum.short_writes += dev->stats[cpu].short_writes;
+        sum.faults += dev->stats[cpu].faults;
+        for(i = 0; i < ENCDEC_IOCTL_COUNTED; i++)
+        {
+            sum.ioctls[i] += dev->stats[cpu].ioctls[i];
+        }
+        for(i = 0; i < ENCDEC_LATENCY_BUCKETS; i++)
+        {
+            sum.cycles[i] += dev->stats[cpu].cycles[i];
+        }
+    }
+    seq_printf(m, "encdec%d (%s):\n", minor, (dev->cipher == ENCDEC_CIPHER_CAESAR) ? "caesar" : "xor");
+    seq_printf(m, "  read bytes: random %lu stream %lu\n", sum.bytes_read[0], sum.bytes_read[1]);
+    seq_printf(m, "  written bytes: random %lu stream %lu\n", sum.bytes_written[0], sum.bytes_written[1]);
+    seq_printf(m, "  short reads: %lu short writes: %lu faults: %lu\n", sum.short_reads, sum.short_writes, sum.faults);
+    seq_printf(m, "  ioctls:");
+    for(i = 0; i < ENCDEC_IOCTL_COUNTED; i++)
+    {
+        seq_printf(m, " %s %lu", ioctl_names[i], sum.ioctls[i]);
+    }
+    seq_printf(m, "\n  request cycles (log2: count):");
+    for(i = 0; i < ENCDEC_LATENCY_BUCKETS; i++)
     {
-        s[i] = s[i] ^ key; /* xor encryption/decryption */
+        if(sum.cycles[i] != 0) /* only the buckets that were used */
+        {
+            seq_printf(m, " %d: %lu", i, sum.cycles[i]);
+        }
     }
+    seq_printf(m, "\n");
 }
+
+/* /proc/encdec is a seq_file with one record per device, the position is the minor of the device, seq_file
+keeps a record that does not fit in the reader's buffer and gives the rest of it to the next reads */
+void* encdec_seq_start(struct seq_file *m, loff_t *pos)
+{
+    return (*pos < device_count) ? &encdec_devices[*pos] : NULL;
+}
+
+void* encdec_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    (*pos)++;
+    return encdec_seq_start(m, pos);
+}
+
+void encdec_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+int encdec_seq_show(struct seq_file *m, void *v)
+{
+    encdec_device** dev = (encdec_device**)v;
+    encdec_proc_device(m, dev - encdec_devices, *dev);
+    return 0;
+}
+
+struct seq_operations encdec_seq_ops = {
+	.start =	encdec_seq_start,
+	.next  =	encdec_seq_next,
+	.stop  =	encdec_seq_stop,
+	.show  =	encdec_seq_show
+};
+
+int encdec_proc_open(struct inode *inode, struct file *filp)
+{
+    return seq_open(filp, &encdec_seq_ops);
+}
+
+struct file_operations encdec_proc_fops = {
+	.open 	 =	encdec_proc_open,
+	.read 	 =	seq_read,
+	.llseek  =	seq_lseek,
+	.release =	seq_release,
+	.owner 	 =	THIS_MODULE
+};
+
 int init_module(void)
 {
+	struct proc_dir_entry *proc_entry;
+	int minor;
+	int cipher;
+	if(device_count < 1 || device_count > ENCDEC_MAX_DEVICES)
+	{
+		return -EINVAL;
+	}
+	for(minor = 0; minor < ENCDEC_MAX_DEVICES; minor++) /* a misspelled cipher fails the load */
+	{
+		if(device_ciphers[minor] != NULL && strcmp(device_ciphers[minor], "caesar") != 0 && strcmp(device_ciphers[minor], "xor") != 0)
+		{
+			return -EINVAL;
+		}
+	}
 	major = register_chrdev(major, MODULE_NAME, &fops_caesar);
 	if(major < 0)
 	{	
@@ -106,39 +505,47 @@ int init_module(void)
 	// -------------------------
 	// 1. Allocate memory for the two device buffers using kmalloc (each of them should be of size 'memory_size')
 	
-    caesar_cipher_buff = kmalloc(memory_size,GFP_KERNEL); /* allocating memory for the caesar buffer in the kernel */
-    if(caesar_cipher_buff == NULL)
+    encdec_zero_page = page_address(ZERO_PAGE(0));
+    /* allocating the devices, the cipher of each one is chosen by device_ciphers */
+    for(minor = 0; minor < device_count; minor++)
     {
-        return -ENOMEM; /* no memory */
+        cipher = minor % 2; /* the two original devices: encdec0 is caesar and encdec1 is xor */
+        if(device_ciphers[minor] != NULL)
+        {
+            cipher = (strcmp(device_ciphers[minor], "xor") == 0) ? ENCDEC_CIPHER_XOR : ENCDEC_CIPHER_CAESAR;
+        }
+        encdec_devices[minor] = encdec_create_device(cipher);
+        if(encdec_devices[minor] == NULL)
+        {
+            while(minor-- > 0)
+            {
+                encdec_free_device(encdec_devices[minor]);
+            }
+            unregister_chrdev(major, MODULE_NAME);
+            return -ENOMEM; /* no memory */
+        }
     }
-    xor_buff = kmalloc(memory_size, GFP_KERNEL);  /* allocating memory for the caesar buffer in the kernel */
-    if(xor_buff == NULL)
+    proc_entry = create_proc_entry(ENCDEC_PROC_NAME, 0, NULL);
+    if(proc_entry != NULL) /* the module works without it */
     {
-        kfree(caesar_cipher_buff); /* free "caesar_cipher_buff" that has allocated before */
-        return -ENOMEM;
+        proc_entry->proc_fops = &encdec_proc_fops;
     }
     
-    memset(caesar_cipher_buff, 0, memory_size); /* set all buffers cells to zero */
-    memset(xor_buff, 0, memory_size);
-    
 	return 0;
 }
 
 void cleanup_module(void)
 {
+	int minor;
 	// Implemetation suggestion:
 	// -------------------------	
 	// 1. Unregister the device-driver
 	// 2. Free the allocated device buffers using kfree
+	remove_proc_entry(ENCDEC_PROC_NAME, NULL);
 	unregister_chrdev(major, MODULE_NAME);
-	if(caesar_cipher_buff != NULL) /* if the buffer is not NULL */
+	for(minor = 0; minor < device_count; minor++)
 	{
-	    kfree(caesar_cipher_buff); /* freeing the allocated memory from the kernel for the caesar buffer */
-	}
-	
-	if(xor_buff != NULL) /* if the buffer is not NULL */
-	{
-	    kfree(xor_buff); /* freeing the allocated memory from the kernel for the caesar buffer */
+		encdec_free_device(encdec_devices[minor]); /* freeing the pages of the buffer */
 	}
 }
 
@@ -152,22 +559,24 @@ int encdec_open(struct inode *inode, struct file *filp)
 	// 2. Allocate memory for 'filp->private_data' as needed (using kmalloc)
 
     encdec_private_date *pd; /* for the private data */
+    encdec_device *dev; /* the device of the minor */
     if(inode == NULL || filp == NULL)
     {
         return -EINVAL;
     }
     
-    if(minor == 0) /* when minor is 0 we will give f_op field to the caesar functions */
+    if(minor >= device_count)
     {
-        filp->f_op = &fops_caesar; 
+        return -ENODEV; /* no such device */
     }
-    else if(minor == 1) /* when minor is 0 we will give f_op field to the xor functions */
+    dev = encdec_devices[minor];
+    if(dev->cipher == ENCDEC_CIPHER_CAESAR) /* for caesar devices we will give f_op field to the caesar functions */
     {
-        filp->f_op = &fops_xor;
+        filp->f_op = &fops_caesar; 
     }
-    else
+    else /* and for xor devices to the xor functions */
     {
-        return -ENODEV; /* no such device */
+        filp->f_op = &fops_xor;
     }
     
     /* allocating memory for the private data */
@@ -180,6 +589,9 @@ int encdec_open(struct inode *inode, struct file *filp)
     filp->private_data = pd; /* private_data pointing to the new allocated memory */
     pd->key = 0; /* set key = 0*/
     pd->read_state = ENCDEC_READ_STATE_DECRYPT; /* set read_state  */
+    pd->mode = ENCDEC_MODE_RANDOM_ACCESS;
+    pd->keystream_length = 0; /* the single byte key */
+    pd->dev = dev;
     
 	return 0;
 }
@@ -198,6 +610,136 @@ int encdec_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+/* setting [pos, pos + count) of the received device buffer to zero (count > 0), the pages that the range covers
+completely are freed (they read as zeros again) and only the partial pages at its edges are cleared, pages that are
+mapped to user space are cleared instead of freed so the mappings see the zeros, the cpu is given up between
+pages when another task needs it (a discard of the whole buffer runs under the BKL in a kernel that does not preempt) */
+void encdec_discard_range(encdec_device* dev, loff_t pos, size_t count)
+{
+    struct page* page;
+    loff_t end = pos + count;
+    loff_t page_start;
+    size_t segment;
+    encdec_lock_range(dev, pos, count, 1);
+    for(; pos < end; pos += segment)
+    {
+        if(current->need_resched)
+        {
+            schedule();
+        }
+        segment = encdec_segment(pos, end - pos);
+        page_start = pos & PAGE_MASK;
+        spin_lock(&dev->page_lock);
+        page = dev->pages[pos >> PAGE_SHIFT];
+        if(page != NULL && segment == PAGE_SIZE && page_count(page) == 1) /* a whole page that only the device uses */
+        {
+            dev->pages[pos >> PAGE_SHIFT] = NULL;
+            spin_unlock(&dev->page_lock);
+            __free_page(page);
+            continue;
+        }
+        spin_unlock(&dev->page_lock);
+        if(page != NULL) /* an edge of the range (or a mapped page) */
+        {
+            memset((char*)page_address(page) + (pos - page_start), 0, segment);
+        }
+    }
+    encdec_unlock_range(dev, end - count, count, 1);
+}
+
+/* ENCDEC_CMD_TRANSFORM, the user buffer goes through a bounce buffer on the stack chunk by chunk and is
+ciphered there, so nothing is allocated and the device buffer and its locks are not touched, the length has
+no limit so the cpu is given up between chunks when another task needs it */
+int encdec_transform_user(encdec_device* dev, struct encdec_transform* transform)
+{
+    char bounce[ENCDEC_CHUNK_SIZE];
+    unsigned long done; /* bytes that were copied back to the user */
+    size_t chunk;
+    void (*cipher)(char* s, size_t amount, unsigned int key);
+    if(transform->direction != ENCDEC_DIRECTION_ENCRYPT && transform->direction != ENCDEC_DIRECTION_DECRYPT)
+    {
+        return -EINVAL;
+    }
+    if(dev->cipher == ENCDEC_CIPHER_CAESAR)
+    {
+        cipher = (transform->direction == ENCDEC_DIRECTION_ENCRYPT) ? caesar_encrypt : caesar_decrypt;
+    }
+    else
+    {
+        cipher = xor_encrypt_decrypt; /* xor is its own inverse */
+    }
+    for(done = 0; done < transform->length; done += chunk)
+    {
+        if(current->need_resched)
+        {
+            schedule();
+        }
+        chunk = (transform->length - done < ENCDEC_CHUNK_SIZE) ? transform->length - done : ENCDEC_CHUNK_SIZE;
+        if(copy_from_user(bounce, transform->in + done, chunk))
+        {
+            return -EFAULT;
+        }
+        cipher(bounce, chunk, transform->key);
+        if(copy_to_user(transform->out + done, bounce, chunk))
+        {
+            return -EFAULT;
+        }
+    }
+    return 0;
+}
+
+/* ENCDEC_CMD_BATCH, running the entries one by one with the same code as the matching syscalls, returns the
+number of entries that ran or -EFAULT if the first entry could not be copied */
+int encdec_run_batch(struct file *filp, struct encdec_batch* batch)
+{
+    encdec_private_date *pd = (encdec_private_date*)filp->private_data;
+    struct encdec_batch_entry entry;
+    unsigned long done;
+    if(batch->count > ENCDEC_BATCH_MAX)
+    {
+        return -EINVAL;
+    }
+    for(done = 0; done < batch->count; done++)
+    {
+        if(copy_from_user(&entry, batch->entries + done, sizeof(entry)))
+        {
+            return (done == 0) ? -EFAULT : done;
+        }
+        switch(entry.cmd)
+        {
+            case(ENCDEC_BATCH_CHANGE_KEY):
+                pd->key = entry.arg;
+                pd->keystream_length = 0;
+                entry.result = 0;
+            break;
+            case(ENCDEC_BATCH_SET_READ_STATE):
+                pd->read_state = entry.arg;
+                entry.result = 0;
+            break;
+            case(ENCDEC_BATCH_SEEK):
+                entry.result = encdec_llseek(filp, entry.arg, SEEK_SET);
+            break;
+            case(ENCDEC_BATCH_READ): /* the mode of the file is checked here like read(2) does */
+                entry.result = (filp->f_mode & FMODE_READ) ? filp->f_op->read(filp, entry.buf, entry.count, &filp->f_pos) : -EBADF;
+            break;
+            case(ENCDEC_BATCH_WRITE):
+                entry.result = (filp->f_mode & FMODE_WRITE) ? filp->f_op->write(filp, entry.buf, entry.count, &filp->f_pos) : -EBADF;
+            break;
+            default:
+                entry.result = -EINVAL;
+        }
+        if(put_user(entry.result, &batch->entries[done].result))
+        {
+            return (done == 0) ? -EFAULT : done;
+        }
+        if(entry.result < 0) /* the next entries may depend on this one */
+        {
+            return done + 1;
+        }
+    }
+    return done;
+}
+
 int encdec_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	// Implemetation suggestion:
@@ -205,37 +747,105 @@ int encdec_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsig
 	// 1. Update the relevant fields in 'filp->private_data' according to the values of 'cmd' and 'arg'
     
     encdec_private_date *pd;
+    encdec_cpu_stats *stats;
+    struct encdec_range range; /* for ENCDEC_CMD_DISCARD */
+    struct encdec_transform transform; /* for ENCDEC_CMD_TRANSFORM */
+    struct encdec_batch batch; /* for ENCDEC_CMD_BATCH */
+    struct encdec_keystream keystream; /* for ENCDEC_CMD_SET_KEYSTREAM */
     if(filp == NULL || inode == NULL)
     {
         return -EINVAL;
     }
     
     pd = (encdec_private_date*)filp->private_data;
+    stats = &pd->dev->stats[smp_processor_id()];
+    stats->ioctls[(cmd < ENCDEC_IOCTL_COUNTED - 1) ? cmd : ENCDEC_IOCTL_COUNTED - 1]++;
     switch(cmd)
     {
         /* set key */
         case(ENCDEC_CMD_CHANGE_KEY):
             pd->key = arg;
+            pd->keystream_length = 0; /* the last key that was set is used */
+        break;
+        /* set a multi-byte xor key (arg points to a struct encdec_keystream) */
+        case(ENCDEC_CMD_SET_KEYSTREAM):
+            if(pd->dev->cipher != ENCDEC_CIPHER_XOR)
+            {
+                return -EINVAL; /* a caesar shift by a repeating key is not supported */
+            }
+            if(copy_from_user(&keystream, (struct encdec_keystream*)arg, sizeof(keystream)))
+            {
+                return -EFAULT;
+            }
+            if(keystream.length > ENCDEC_KEYSTREAM_MAX)
+            {
+                return -EINVAL;
+            }
+            pd->keystream_length = 0;
+            if(keystream.length > 0)
+            {
+                pd->keystream_stride = encdec_expand_key(pd->keystream, keystream.key, keystream.length);
+                pd->keystream_length = keystream.length;
+            }
         break;
         /* set read_state */
         case(ENCDEC_CMD_SET_READ_STATE):
             pd->read_state = arg;
         break;
+        /* set mode */
+        case(ENCDEC_CMD_SET_MODE):
+            if((arg != ENCDEC_MODE_RANDOM_ACCESS && arg != ENCDEC_MODE_STREAM) ||
+               (arg == ENCDEC_MODE_STREAM && memory_size <= 0)) /* a ring needs room */
+            {
+                return -EINVAL;
+            }
+            pd->mode = arg;
+        break;
         /* set all the required buffer cells to zero */
         case(ENCDEC_CMD_ZERO):
-            if(MINOR(inode->i_rdev) == 0) /* for caesar buffer */
+            if(memory_size == 0)
             {
-                memset(caesar_cipher_buff, 0, memory_size);
+                break;
             }
-            else if(MINOR(inode->i_rdev) == 1) /* for xor buffer */
+            encdec_discard_range(pd->dev, 0, memory_size); /* the whole buffer of the opened device */
+        break;
+        /* set the cells of a range to zero (arg points to a struct encdec_range) */
+        case(ENCDEC_CMD_DISCARD):
+            if(copy_from_user(&range, (struct encdec_range*)arg, sizeof(range)))
             {
-                memset(xor_buff, 0, memory_size);
+                return -EFAULT;
             }
-            else
+            if(range.offset > memory_size)
             {
-                return -ENODEV; /* if minor was unexpected value */
+                return -EINVAL;
+            }
+            if(range.length > memory_size - range.offset) /* discarding till memory_size */
+            {
+                range.length = memory_size - range.offset;
+            }
+            if(range.length > 0)
+            {
+                encdec_discard_range(pd->dev, range.offset, range.length);
             }
         break;
+        /* cipher a user buffer without the device buffer (arg points to a struct encdec_transform) */
+        case(ENCDEC_CMD_TRANSFORM):
+            if(copy_from_user(&transform, (struct encdec_transform*)arg, sizeof(transform)))
+            {
+                return -EFAULT;
+            }
+            return encdec_transform_user(pd->dev, &transform);
+        /* run several sub-commands in one call (arg points to a struct encdec_batch) */
+        case(ENCDEC_CMD_BATCH):
+            if(copy_from_user(&batch, (struct encdec_batch*)arg, sizeof(batch)))
+            {
+                return -EFAULT;
+            }
+            return encdec_run_batch(filp, &batch);
+        /* clear the counters of /proc/encdec for this device */
+        case(ENCDEC_CMD_RESET_STATS):
+            memset(pd->dev->stats, 0, sizeof(pd->dev->stats));
+        break;
     }
     
 	return 0;
@@ -248,8 +858,223 @@ int encdec_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsig
 // 3. ssize_t encdec_read_xor( struct file *filp, char *buf, size_t count, loff_t *f_pos );
 // 4. ssize_t encdec_write_xor(struct file *filp, const char *buf, size_t count, loff_t *f_pos);
 
-ssize_t encdec_read_caesar( struct file *filp, char *buf, size_t count, loff_t *f_pos )
+/* copying the bytes [pos, pos + count) of the device buffer to the user buffer, raw or decrypted by the
+read_state of the file, the caller holds the read locks of the range, returns 0 or -EFAULT */
+int encdec_read_locked(encdec_device* dev, encdec_private_date* pd, char *buf, loff_t pos, size_t count,
+                       void (*decrypt)(char* dst, const char* src, size_t amount, unsigned char key))
+{
+    int result = 0;
+    size_t done; /* bytes that were copied to the user */
+    size_t segment; /* bytes of the current page */
+    for(done = 0; done < count && result == 0; done += segment) /* page by page */
+    {
+        segment = encdec_segment(pos + done, count - done);
+        if(pd->read_state == ENCDEC_READ_STATE_RAW)
+        {
+            if(copy_to_user(buf + done, encdec_addr(dev, pos + done), segment)) /* copying raw data to user buffer */
+            {
+                result = -EFAULT;
+            }
+        }
+        else if(pd->keystream_length != 0) /* the multi-byte xor key lines up with the offset in the buffer */
+        {
+            result = encdec_copy_keystream(buf + done, encdec_addr(dev, pos + done), segment, pos + done, pd);
+        }
+        else
+        {
+            /* copying decrypted data to user buffer (the device buffer stays encrypted) */
+            result = encdec_copy_decrypted(buf + done, encdec_addr(dev, pos + done), segment, pd->key, decrypt);
+        }
+    }
+    return result;
+}
+
+/* copying and encrypting 'count' bytes of the user buffer to [pos, pos + count) of the device buffer, the
+bytes are copied chunk by chunk into a bounce buffer on the stack and encrypted from there into the page, so
+the page never holds plain text (mapped readers take no locks, and a fault in the middle leaves none behind),
+the caller holds the write locks of the range, returns the bytes that were written (less than count when a
+page could not be allocated), -ENOMEM if none were, or -EFAULT */
+ssize_t encdec_write_locked(encdec_device* dev, encdec_private_date* pd, const char *buf, loff_t pos, size_t count,
+                            void (*encrypt)(char* dst, const char* src, size_t amount, unsigned char key))
+{
+    char bounce[ENCDEC_CHUNK_SIZE];
+    size_t done; /* bytes that were copied from the user */
+    size_t segment; /* bytes of the current page */
+    size_t chunk; /* bytes of the current piece of the page */
+    size_t offset; /* where the current piece starts in the page */
+    char* addr; /* where the current page is written */
+    for(done = 0; done < count; done += segment) /* page by page */
+    {
+        segment = encdec_segment(pos + done, count - done);
+        addr = encdec_write_addr(dev, pos + done);
+        if(addr == NULL) /* no memory for the page, writing only what was written till here */
+        {
+            return (done == 0) ? -ENOMEM : done;
+        }
+        for(offset = 0; offset < segment; offset += chunk)
+        {
+            chunk = (segment - offset < ENCDEC_CHUNK_SIZE) ? segment - offset : ENCDEC_CHUNK_SIZE;
+            if(copy_from_user(bounce, buf + done + offset, chunk) != 0)
+            {
+                return -EFAULT;
+            }
+            if(pd->keystream_length != 0) /* the multi-byte xor key lines up with the offset in the buffer */
+            {
+                encdec_xor_key(addr + offset, bounce, chunk, pos + done + offset, pd->keystream, pd->keystream_length, pd->keystream_stride);
+            }
+            else
+            {
+                encrypt(addr + offset, bounce, chunk, pd->key);
+            }
+        }
+    }
+    return count;
+}
+
+/* ENCDEC_MODE_STREAM read, waits till the ring has bytes (or returns -EAGAIN if nonblock) and takes as many
+of them as fit in count, the bytes are copied before the tail moves so the producer can not overwrite them,
+the region locks of every piece are taken like a random access read so discards and other fds see whole pieces */
+ssize_t encdec_read_stream(encdec_device* dev, encdec_private_date* pd, char *buf, size_t count, int nonblock,
+                           void (*decrypt)(char* dst, const char* src, size_t amount, unsigned char key))
+{
+    unsigned long head;
+    unsigned long tail;
+    unsigned long pos; /* where the current piece starts in the buffer */
+    size_t chunk;
+    size_t done;
+    int result = 0;
+    if(pd->read_state != ENCDEC_READ_STATE_RAW && pd->read_state != ENCDEC_READ_STATE_DECRYPT)
+    {
+        return -EINVAL; /* unexpected read_state */
+    }
+    if(count == 0)
+    {
+        return 0;
+    }
+    if(down_interruptible(&dev->stream_consumer))
+    {
+        return -ERESTARTSYS;
+    }
+    tail = dev->stream_tail;
+    while((head = dev->stream_head) == tail) /* the ring is empty */
+    {
+        if(nonblock)
+        {
+            up(&dev->stream_consumer);
+            return -EAGAIN;
+        }
+        if(wait_event_interruptible(dev->stream_readable, dev->stream_head != tail))
+        {
+            up(&dev->stream_consumer);
+            return -ERESTARTSYS;
+        }
+    }
+    smp_rmb(); /* the bytes are read after the head that published them */
+    if(count > head - tail)
+    {
+        count = head - tail;
+    }
+    for(done = 0; done < count && result == 0; done += chunk) /* the ring may wrap in the middle */
+    {
+        pos = (tail + done) % memory_size;
+        chunk = (count - done < memory_size - pos) ? count - done : memory_size - pos;
+        encdec_lock_range(dev, pos, chunk, 0); /* so a discard can not free the pages under us */
+        result = encdec_read_locked(dev, pd, buf + done, pos, chunk, decrypt);
+        encdec_unlock_range(dev, pos, chunk, 0);
+    }
+    if(result == 0)
+    {
+        smp_mb(); /* the bytes are read before the producer is allowed to overwrite them */
+        dev->stream_tail = tail + count;
+        wake_up_interruptible(&dev->stream_writable);
+    }
+    up(&dev->stream_consumer);
+    return (result < 0) ? result : count;
+}
+
+/* ENCDEC_MODE_STREAM write, puts all the bytes into the ring and waits for room when it is full like a pipe,
+if nonblock it puts only what fits (-EAGAIN if nothing does), each piece is encrypted before the head
+publishes it */
+ssize_t encdec_write_stream(encdec_device* dev, encdec_private_date* pd, const char *buf, size_t count, int nonblock,
+                            void (*encrypt)(char* dst, const char* src, size_t amount, unsigned char key))
+{
+    unsigned long head;
+    unsigned long room; /* bytes of the ring that are free */
+    unsigned long pos;
+    size_t chunk;
+    size_t done = 0;
+    ssize_t written;
+    ssize_t result = 0;
+    if(count == 0)
+    {
+        return 0;
+    }
+    if(down_interruptible(&dev->stream_producer))
+    {
+        return -ERESTARTSYS;
+    }
+    head = dev->stream_head;
+    while(done < count)
+    {
+        room = memory_size - (head - dev->stream_tail);
+        if(room == 0) /* the ring is full */
+        {
+            if(nonblock)
+            {
+                result = -EAGAIN;
+                break;
+            }
+            if(wait_event_interruptible(dev->stream_writable, head - dev->stream_tail < memory_size))
+            {
+                result = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+        smp_mb(); /* the bytes that the tail freed are written only after the consumer read them */
+        pos = head % memory_size;
+        chunk = count - done;
+        if(chunk > room)
+        {
+            chunk = room;
+        }
+        if(chunk > memory_size - pos) /* till the end of the buffer, the rest wraps */
+        {
+            chunk = memory_size - pos;
+        }
+        encdec_lock_range(dev, pos, chunk, 1); /* against discards and random access writers of the same bytes */
+        written = encdec_write_locked(dev, pd, buf + done, pos, chunk, encrypt);
+        encdec_unlock_range(dev, pos, chunk, 1);
+        if(written < 0)
+        {
+            result = written;
+            break;
+        }
+        smp_wmb(); /* the bytes are written before the head that publishes them */
+        head += written;
+        done += written;
+        dev->stream_head = head;
+        wake_up_interruptible(&dev->stream_readable);
+        if(written < chunk) /* out of memory */
+        {
+            break;
+        }
+    }
+    up(&dev->stream_producer);
+    return (done > 0) ? done : result;
+}
+
+/* reading from the received device buffer, the regions we read are locked for reading so other
+readers can read them with us but no writer can change them in the middle */
+ssize_t encdec_read_device(encdec_device* dev, struct file *filp, char *buf, size_t count, loff_t *f_pos,
+                           void (*decrypt)(char* dst, const char* src, size_t amount, unsigned char key))
 {
+    int result;
+    if((filp != NULL) && (filp->private_data != NULL) &&
+       (((encdec_private_date*)(filp->private_data))->mode == ENCDEC_MODE_STREAM)) /* reading from the ring */
+    {
+        return encdec_read_stream(dev, (encdec_private_date*)(filp->private_data), buf, count, filp->f_flags & O_NONBLOCK, decrypt);
+    }
     if(*f_pos >= memory_size) /* when f_ops value geater than the memory_size */
     {
         return -EINVAL;
@@ -264,28 +1089,17 @@ ssize_t encdec_read_caesar( struct file *filp, char *buf, size_t count, loff_t *
         
         if(count > 0) /* there are chars to read */
         {
-            if((((encdec_private_date*)(filp->private_data))->read_state) == ENCDEC_READ_STATE_RAW)
+            if((((encdec_private_date*)(filp->private_data))->read_state) != ENCDEC_READ_STATE_RAW &&
+               (((encdec_private_date*)(filp->private_data))->read_state) != ENCDEC_READ_STATE_DECRYPT)
             {
-                if(copy_to_user(buf, caesar_cipher_buff + (*f_pos), count)) /* copying raw data to user buffer */
-                {
-                    return -EFAULT;
-                }
+                return -EINVAL; /* unexpected read_state */
             }
-            else if((((encdec_private_date*)(filp->private_data))->read_state) == ENCDEC_READ_STATE_DECRYPT)
+            encdec_lock_range(dev, *f_pos, count, 0);
+            result = encdec_read_locked(dev, (encdec_private_date*)(filp->private_data), buf, *f_pos, count, decrypt);
+            encdec_unlock_range(dev, *f_pos, count, 0);
+            if(result < 0)
             {
-                /* copying raw data to user buffer (decrypting at first and encrypting after that) */
-                caesar_decrypt(caesar_cipher_buff + (*f_pos), count, ((encdec_private_date*)(filp->private_data))->key);
-                if(copy_to_user(buf, caesar_cipher_buff + (*f_pos), count)) 
-                {
-                    caesar_encrypt(caesar_cipher_buff + (*f_pos), count, ((encdec_private_date*)(filp->private_data))->key);
-                    return -EFAULT;
-                }
-                caesar_encrypt(caesar_cipher_buff + (*f_pos), count, ((encdec_private_date*)(filp->private_data))->key);
-
-            }
-            else
-            {
-                return -EINVAL; /* unexpected read_state */
+                return result;
             }
             (*f_pos) = (*f_pos) + count; /* moving forward the f_ops after reading */
             return count; /* the chars that we read */
@@ -295,8 +1109,17 @@ ssize_t encdec_read_caesar( struct file *filp, char *buf, size_t count, loff_t *
     return -EINVAL;
 }
 
-ssize_t encdec_write_caesar(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+/* writing to the received device buffer, the regions we write are locked for writing so the
+plain text that we copy is encrypted before any reader can see it */
+ssize_t encdec_write_device(encdec_device* dev, struct file *filp, const char *buf, size_t count, loff_t *f_pos,
+                            void (*encrypt)(char* dst, const char* src, size_t amount, unsigned char key))
 {
+    ssize_t written;
+    if((filp != NULL) && (filp->private_data != NULL) &&
+       (((encdec_private_date*)(filp->private_data))->mode == ENCDEC_MODE_STREAM)) /* writing to the ring */
+    {
+        return encdec_write_stream(dev, (encdec_private_date*)(filp->private_data), buf, count, filp->f_flags & O_NONBLOCK, encrypt);
+    }
     if(*f_pos >= memory_size) /* when f_ops value geater than the memory_size */
     {
         return -ENOSPC;
@@ -311,89 +1134,407 @@ ssize_t encdec_write_caesar(struct file *filp, const char *buf, size_t count, lo
     {
         count = memory_size - (*f_pos); /* writing the amount till memory_size */
     }
+    if(count == 0)
+    {
+        return 0;
+    }
 
-    if(copy_from_user(caesar_cipher_buff + (*f_pos), buf, count) != 0) /* copying from user to caesar buffer */
+    encdec_lock_range(dev, *f_pos, count, 1);
+    written = encdec_write_locked(dev, (encdec_private_date*)(filp->private_data), buf, *f_pos, count, encrypt);
+    encdec_unlock_range(dev, *f_pos, count, 1);
+    if(written > 0)
     {
-        return -EFAULT;
+        (*f_pos) = (*f_pos) + written;/* moving forward the f_ops after writing */
     }
-    /* encrypting the data that we copied using caesar encryption */
-    caesar_encrypt(caesar_cipher_buff + (*f_pos), count, ((encdec_private_date*)(filp->private_data))->key);
-    (*f_pos) = (*f_pos) + count;/* moving forward the f_ops after reading */
 
-    return count; /* the chars that we write */
+    return written; /* the chars that we write */
 }
 
-ssize_t encdec_read_xor( struct file *filp, char *buf, size_t count, loff_t *f_pos )
+/* the total length of an iovec array, or -EINVAL if it overflows */
+ssize_t encdec_iov_length(const struct iovec *iov, unsigned long nr_segs)
 {
-    if(*f_pos >= memory_size) /* when f_ops value geater than the memory_size */
+    size_t total = 0;
+    unsigned long seg;
+    for(seg = 0; seg < nr_segs; seg++)
+    {
+        if(total + iov[seg].iov_len < total)
+        {
+            return -EINVAL;
+        }
+        total += iov[seg].iov_len;
+    }
+    if((ssize_t)total < 0)
     {
         return -EINVAL;
     }
-    
-    if((filp != NULL) && (filp->private_data != NULL))
+    return total;
+}
+
+/* readv, the bytes of the device buffer from *f_pos on are scattered over the segments, the whole range is
+locked once so the segments are one consistent snapshot (the kernel's fallback calls read per segment) */
+ssize_t encdec_readv_device(encdec_device* dev, struct file *filp, const struct iovec *iov, unsigned long nr_segs,
+                            loff_t *f_pos, void (*decrypt)(char* dst, const char* src, size_t amount, unsigned char key))
+{
+    encdec_private_date* pd;
+    ssize_t count = encdec_iov_length(iov, nr_segs);
+    size_t done = 0; /* bytes that were copied to the user */
+    size_t len; /* bytes of the current segment */
+    unsigned long seg;
+    int result = 0;
+    ssize_t got; /* bytes of a segment that were taken from the ring */
+    if(count < 0)
     {
-        if (((*f_pos) + count) > memory_size) /* the number of the required chars to read exceeds the memory_size */
-        {
-            count = memory_size - (*f_pos); /* reading the amount till memory_size */
-        }
-        
-        if(count > 0) /* there are chars to read */
+        return count;
+    }
+    if((filp != NULL) && (filp->private_data != NULL) &&
+       (((encdec_private_date*)(filp->private_data))->mode == ENCDEC_MODE_STREAM))
+    {
+        /* like a pipe only the first segment may wait, the others take what is already in the ring */
+        for(seg = 0; seg < nr_segs; seg++)
         {
-            if((((encdec_private_date*)(filp->private_data))->read_state) == ENCDEC_READ_STATE_RAW)
+            got = encdec_read_stream(dev, (encdec_private_date*)(filp->private_data), iov[seg].iov_base, iov[seg].iov_len,
+                                     (filp->f_flags & O_NONBLOCK) || (done > 0), decrypt);
+            if(got < 0)
             {
-                if(copy_to_user(buf, xor_buff + (*f_pos), count))/* copying raw data to user buffer */
-                {
-                    return -EFAULT;
-                }
+                return (done > 0) ? done : got;
             }
-            else if((((encdec_private_date*)(filp->private_data))->read_state) == ENCDEC_READ_STATE_DECRYPT)
+            done += got;
+            if(got < iov[seg].iov_len)
             {
-                /* copying raw data to user buffer (decrypting at first and encrypting after that by using xor encryption) */
-                xor_encrypt_decrypt(xor_buff + (*f_pos), count, ((encdec_private_date*)(filp->private_data))->key);
-                if(copy_to_user(buf, xor_buff + (*f_pos), count))
-                {
-                    xor_encrypt_decrypt(xor_buff + (*f_pos), count, ((encdec_private_date*)(filp->private_data))->key);
-                    return -EFAULT;
-                }
-                xor_encrypt_decrypt(xor_buff + (*f_pos), count, ((encdec_private_date*)(filp->private_data))->key);
+                break;
+            }
+        }
+        return done;
+    }
+    if((filp == NULL) || (filp->private_data == NULL) || (*f_pos >= memory_size) || (count == 0))
+    {
+        return -EINVAL; /* same as read */
+    }
+    pd = (encdec_private_date*)(filp->private_data);
+    if(pd->read_state != ENCDEC_READ_STATE_RAW && pd->read_state != ENCDEC_READ_STATE_DECRYPT)
+    {
+        return -EINVAL; /* unexpected read_state */
+    }
+    if(((*f_pos) + count) > memory_size) /* reading the amount till memory_size */
+    {
+        count = memory_size - (*f_pos);
+    }
+
+    encdec_lock_range(dev, *f_pos, count, 0);
+    for(seg = 0; seg < nr_segs && done < count && result == 0; seg++)
+    {
+        len = (iov[seg].iov_len < count - done) ? iov[seg].iov_len : count - done;
+        result = encdec_read_locked(dev, pd, iov[seg].iov_base, *f_pos + done, len, decrypt);
+        done += len;
+    }
+    encdec_unlock_range(dev, *f_pos, count, 0);
+    if(result < 0)
+    {
+        return result;
+    }
+    (*f_pos) = (*f_pos) + count;
+    return count;
+}
 
+/* writev, the segments are gathered into the device buffer from *f_pos on under one lock of the whole
+range, so no reader sees only some of them */
+ssize_t encdec_writev_device(encdec_device* dev, struct file *filp, const struct iovec *iov, unsigned long nr_segs,
+                             loff_t *f_pos, void (*encrypt)(char* dst, const char* src, size_t amount, unsigned char key))
+{
+    ssize_t count = encdec_iov_length(iov, nr_segs);
+    ssize_t written = 0; /* bytes of the current segment that were written */
+    size_t done = 0; /* bytes that were written */
+    size_t len; /* bytes of the current segment */
+    unsigned long seg;
+    if(count < 0)
+    {
+        return count;
+    }
+    if((filp != NULL) && (filp->private_data != NULL) &&
+       (((encdec_private_date*)(filp->private_data))->mode == ENCDEC_MODE_STREAM))
+    {
+        for(seg = 0; seg < nr_segs; seg++) /* the segments go into the ring one after the other */
+        {
+            written = encdec_write_stream(dev, (encdec_private_date*)(filp->private_data), iov[seg].iov_base, iov[seg].iov_len,
+                                          filp->f_flags & O_NONBLOCK, encrypt);
+            if(written < 0)
+            {
+                return (done > 0) ? done : written;
             }
-            else
+            done += written;
+            if(written < iov[seg].iov_len)
             {
-                return -EINVAL;
+                break;
             }
-            (*f_pos) = (*f_pos) + count;/* moving forward the f_ops after reading */
-            return count; /* the chars that we read */
         }
-        
+        return done;
     }
-    return -EINVAL;
+    if(*f_pos >= memory_size) /* same as write */
+    {
+        return -ENOSPC;
+    }
+    if((filp == NULL) || (filp->private_data == NULL))
+    {
+        return -EINVAL;
+    }
+    if(((*f_pos) + count) > memory_size) /* writing the amount till memory_size */
+    {
+        count = memory_size - (*f_pos);
+    }
+    if(count == 0)
+    {
+        return 0;
+    }
+
+    encdec_lock_range(dev, *f_pos, count, 1);
+    for(seg = 0; seg < nr_segs && done < count; seg++)
+    {
+        len = (iov[seg].iov_len < count - done) ? iov[seg].iov_len : count - done;
+        written = encdec_write_locked(dev, (encdec_private_date*)(filp->private_data), iov[seg].iov_base, *f_pos + done, len, encrypt);
+        if(written < 0)
+        {
+            break;
+        }
+        done += written;
+        if(written < len) /* out of memory */
+        {
+            break;
+        }
+    }
+    encdec_unlock_range(dev, *f_pos, count, 1);
+    if(written == -EFAULT || done == 0)
+    {
+        return (written < 0) ? written : 0;
+    }
+    (*f_pos) = (*f_pos) + done;
+    return done;
+}
+
+/* moving the file position, SEEK_END is relative to memory_size, positions after the end are allowed
+(reading there fails like reading after the end with read) */
+loff_t encdec_llseek(struct file *filp, loff_t offset, int whence)
+{
+    loff_t pos;
+    if((filp->private_data != NULL) && (((encdec_private_date*)(filp->private_data))->mode == ENCDEC_MODE_STREAM))
+    {
+        return -ESPIPE; /* a stream has no position */
+    }
+    switch(whence)
+    {
+        case(SEEK_SET):
+            pos = offset;
+        break;
+        case(SEEK_CUR):
+            pos = filp->f_pos + offset;
+        break;
+        case(SEEK_END):
+            pos = memory_size + offset;
+        break;
+        default:
+            return -EINVAL;
+    }
+    if(pos < 0)
+    {
+        return -EINVAL;
+    }
+    filp->f_pos = pos;
+    return pos;
+}
+
+/* counting a finished read or write request (of 'asked' bytes, that returned 'result' and started at 'start')
+in the counters of the current cpu, returns result */
+ssize_t encdec_account(struct file *filp, int write, size_t asked, ssize_t result, cycles_t start)
+{
+    encdec_private_date* pd;
+    encdec_cpu_stats* stats;
+    cycles_t cycles = get_cycles() - start;
+    int bucket = 0;
+    if((filp == NULL) || (filp->private_data == NULL))
+    {
+        return result;
+    }
+    pd = (encdec_private_date*)(filp->private_data);
+    stats = &pd->dev->stats[smp_processor_id()];
+    if(result == -EFAULT)
+    {
+        stats->faults++;
+    }
+    if(result < 0)
+    {
+        return result;
+    }
+    if(write)
+    {
+        stats->bytes_written[pd->mode] += result;
+        stats->short_writes += (result < asked);
+    }
+    else
+    {
+        stats->bytes_read[pd->mode] += result;
+        stats->short_reads += (result < asked);
+    }
+    while((cycles >>= 1) != 0 && bucket < ENCDEC_LATENCY_BUCKETS - 1) /* log2 */
+    {
+        bucket++;
+    }
+    stats->cycles[bucket]++;
+    return result;
+}
+
+/* the length that a vectored request asked for, for encdec_account */
+size_t encdec_iov_asked(const struct iovec *iov, unsigned long nr_segs)
+{
+    ssize_t length = encdec_iov_length(iov, nr_segs);
+    return (length < 0) ? 0 : length;
+}
+
+/* the device of an open file, NULL if the file is not set up (the read and write paths check the file first) */
+encdec_device* encdec_file_device(struct file *filp)
+{
+    if((filp == NULL) || (filp->private_data == NULL))
+    {
+        return NULL;
+    }
+    return ((encdec_private_date*)(filp->private_data))->dev;
+}
+
+ssize_t encdec_read_caesar( struct file *filp, char *buf, size_t count, loff_t *f_pos )
+{
+    cycles_t start = get_cycles();
+    return encdec_account(filp, 0, count, encdec_read_device(encdec_file_device(filp), filp, buf, count, f_pos, caesar_decrypt_copy), start);
+}
+
+ssize_t encdec_write_caesar(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+{
+    cycles_t start = get_cycles();
+    return encdec_account(filp, 1, count, encdec_write_device(encdec_file_device(filp), filp, buf, count, f_pos, caesar_encrypt_copy), start);
+}
+
+ssize_t encdec_read_xor( struct file *filp, char *buf, size_t count, loff_t *f_pos )
+{
+    cycles_t start = get_cycles();
+    return encdec_account(filp, 0, count, encdec_read_device(encdec_file_device(filp), filp, buf, count, f_pos, xor_decrypt_copy), start);
 }
 
 ssize_t encdec_write_xor(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
 {
-    if(*f_pos >= memory_size) /* when f_ops value geater than the memory_size */
+    cycles_t start = get_cycles();
+    return encdec_account(filp, 1, count, encdec_write_device(encdec_file_device(filp), filp, buf, count, f_pos, xor_encrypt_copy), start);
+}
+
+ssize_t encdec_readv_caesar(struct file *filp, const struct iovec *iov, unsigned long nr_segs, loff_t *f_pos)
+{
+    cycles_t start = get_cycles();
+    return encdec_account(filp, 0, encdec_iov_asked(iov, nr_segs),
+                          encdec_readv_device(encdec_file_device(filp), filp, iov, nr_segs, f_pos, caesar_decrypt_copy), start);
+}
+
+ssize_t encdec_writev_caesar(struct file *filp, const struct iovec *iov, unsigned long nr_segs, loff_t *f_pos)
+{
+    cycles_t start = get_cycles();
+    return encdec_account(filp, 1, encdec_iov_asked(iov, nr_segs),
+                          encdec_writev_device(encdec_file_device(filp), filp, iov, nr_segs, f_pos, caesar_encrypt_copy), start);
+}
+
+ssize_t encdec_readv_xor(struct file *filp, const struct iovec *iov, unsigned long nr_segs, loff_t *f_pos)
+{
+    cycles_t start = get_cycles();
+    return encdec_account(filp, 0, encdec_iov_asked(iov, nr_segs),
+                          encdec_readv_device(encdec_file_device(filp), filp, iov, nr_segs, f_pos, xor_decrypt_copy), start);
+}
+
+ssize_t encdec_writev_xor(struct file *filp, const struct iovec *iov, unsigned long nr_segs, loff_t *f_pos)
+{
+    cycles_t start = get_cycles();
+    return encdec_account(filp, 1, encdec_iov_asked(iov, nr_segs),
+                          encdec_writev_device(encdec_file_device(filp), filp, iov, nr_segs, f_pos, xor_encrypt_copy), start);
+}
+
+/* in ENCDEC_MODE_STREAM a file is readable when the ring has bytes and writable when it has room, in
+ENCDEC_MODE_RANDOM_ACCESS reads and writes never wait */
+unsigned int encdec_poll(struct file *filp, poll_table *wait)
+{
+    encdec_device* dev;
+    unsigned int mask = 0;
+    unsigned long used; /* bytes in the ring */
+    if((filp == NULL) || (filp->private_data == NULL))
     {
-        return -ENOSPC;
+        return POLLERR;
     }
-    
-    if((filp == NULL) || (filp->private_data == NULL)) /* filp or it's private_data is NULL */
+    if(((encdec_private_date*)(filp->private_data))->mode != ENCDEC_MODE_STREAM)
     {
-        return -EINVAL;   
+        return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
     }
-    
-    if (((*f_pos) + count) > memory_size) /* the number of the required chars to write exceeds the memory_size */
+    dev = ((encdec_private_date*)(filp->private_data))->dev;
+    poll_wait(filp, &dev->stream_readable, wait);
+    poll_wait(filp, &dev->stream_writable, wait);
+    used = dev->stream_head - dev->stream_tail;
+    if(used > 0)
     {
-        count = memory_size - (*f_pos); /* writing the amount till memory_size */
+        mask |= POLLIN | POLLRDNORM;
+    }
+    if(used < memory_size)
+    {
+        mask |= POLLOUT | POLLWRNORM;
     }
+    return mask;
+}
 
-    if(copy_from_user(xor_buff + (*f_pos), buf, count) != 0) /* copying from user to xor buffer */
+/* returns the page of the device buffer that the faulting address of a mapping refers to */
+struct page* encdec_vma_nopage(struct vm_area_struct *vma, unsigned long address, int unused)
+{
+    encdec_device* dev = (encdec_device*)vma->vm_private_data;
+    unsigned long index = ((address - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+    struct page* page;
+    if(index >= dev->nr_pages) /* after the end of the buffer */
     {
-        return -EFAULT;
+        return NOPAGE_SIGBUS;
     }
-    /* encrypting the data that we copied using xor encryption */
-    xor_encrypt_decrypt(xor_buff + (*f_pos), count, ((encdec_private_date*)(filp->private_data))->key);
-    (*f_pos) = (*f_pos) + count;
-    
-    return count; /* the chars that we write */
+    while(1)
+    {
+        spin_lock(&dev->page_lock); /* so ENCDEC_CMD_ZERO can not free the page before we take our reference */
+        page = dev->pages[index];
+        if(page != NULL)
+        {
+            get_page(page); /* the mapping holds a reference to the page */
+        }
+        spin_unlock(&dev->page_lock);
+        if(page != NULL)
+        {
+            return page;
+        }
+        if(encdec_get_page(dev, index) == NULL) /* the mapped page must be a real page so writes to it reach the device */
+        {
+            return NOPAGE_OOM;
+        }
+    }
+}
+
+struct vm_operations_struct encdec_vm_ops = {
+	.nopage  =	encdec_vma_nopage
+};
+
+/* mapping the pages of the device buffer to user space, the mapping gives zero-copy access to the
+encrypted data (like ENCDEC_READ_STATE_RAW), it is writable only if the file was opened for writing */
+int encdec_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    encdec_device* dev;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    if((filp == NULL) || (filp->private_data == NULL))
+    {
+        return -EINVAL;
+    }
+    dev = ((encdec_private_date*)(filp->private_data))->dev;
+    if(vma->vm_pgoff + (size >> PAGE_SHIFT) > dev->nr_pages) /* the mapping must be inside the buffer */
+    {
+        return -EINVAL;
+    }
+    if((vma->vm_flags & VM_WRITE) && !(filp->f_mode & FMODE_WRITE))
+    {
+        return -EACCES;
+    }
+    vma->vm_ops = &encdec_vm_ops;
+    vma->vm_flags |= VM_RESERVED; /* the pages are never swapped out */
+    vma->vm_private_data = dev;
+    return 0;
 }
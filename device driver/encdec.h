@@ -4,8 +4,70 @@
 #define ENCDEC_CMD_CHANGE_KEY		0
 #define ENCDEC_CMD_SET_READ_STATE	1
 #define ENCDEC_CMD_ZERO				2
+#define ENCDEC_CMD_DISCARD			3
+#define ENCDEC_CMD_TRANSFORM		4
+#define ENCDEC_CMD_BATCH			5
+#define ENCDEC_CMD_SET_MODE			6
+#define ENCDEC_CMD_RESET_STATS		7
+#define ENCDEC_CMD_SET_KEYSTREAM	8
 
 #define ENCDEC_READ_STATE_RAW		0
 #define ENCDEC_READ_STATE_DECRYPT	1
 
+/* modes of an open file (ENCDEC_CMD_SET_MODE) */
+#define ENCDEC_MODE_RANDOM_ACCESS	0	/* the buffer is read and written at the file position */
+#define ENCDEC_MODE_STREAM			1	/* the buffer is a pipe, reads take what writes put */
+
+#define ENCDEC_DIRECTION_ENCRYPT	0
+#define ENCDEC_DIRECTION_DECRYPT	1
+
+/* the argument of ENCDEC_CMD_DISCARD, the cells [offset, offset + length) are set to zero */
+struct encdec_range {
+	unsigned long offset;
+	unsigned long length;
+};
+
+/* the argument of ENCDEC_CMD_TRANSFORM, 'length' bytes of 'in' are encrypted or decrypted with 'key' by the
+cipher of the device into 'out' (which may be 'in'), the device buffer is not used */
+struct encdec_transform {
+	const char* in;
+	char* out;
+	unsigned long length;
+	unsigned char key;
+	int direction; /* ENCDEC_DIRECTION_ENCRYPT or ENCDEC_DIRECTION_DECRYPT */
+};
+
+/* the sub-commands of ENCDEC_CMD_BATCH */
+#define ENCDEC_BATCH_CHANGE_KEY		0	/* arg is the key */
+#define ENCDEC_BATCH_SET_READ_STATE	1	/* arg is the read state */
+#define ENCDEC_BATCH_SEEK			2	/* arg is the new position (from the start) */
+#define ENCDEC_BATCH_READ			3	/* count bytes are read into buf */
+#define ENCDEC_BATCH_WRITE			4	/* count bytes of buf are written */
+
+#define ENCDEC_BATCH_MAX			64	/* entries in one ENCDEC_CMD_BATCH */
+
+struct encdec_batch_entry {
+	int cmd;
+	long arg;
+	char* buf;
+	unsigned long count;
+	long result; /* set by the driver, what the matching syscall would return (or -errno) */
+};
+
+/* the argument of ENCDEC_CMD_BATCH, the entries run in order till one fails, the ioctl returns the
+number of entries that ran (their result fields are set) */
+struct encdec_batch {
+	struct encdec_batch_entry* entries;
+	unsigned long count;
+};
+
+#define ENCDEC_KEYSTREAM_MAX		64	/* bytes of a multi-byte xor key */
+
+/* the argument of ENCDEC_CMD_SET_KEYSTREAM (xor devices only), the byte at offset pos of the buffer is xored
+with key[pos % length] instead of the single byte key, length 0 goes back to the single byte key */
+struct encdec_keystream {
+	unsigned long length;
+	unsigned char key[ENCDEC_KEYSTREAM_MAX];
+};
+
 #endif
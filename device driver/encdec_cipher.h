@@ -0,0 +1,138 @@
+#ifndef _ENCDEC_CIPHER_H_
+#define _ENCDEC_CIPHER_H_
+
+/* The cipher kernels of the encdec driver. They work on a machine word at a time and depend on nothing
+from the kernel, so the userspace test can build them and compare them with the byte loops. */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stddef.h>
+#include <string.h>
+#endif
+
+#define ENCDEC_WORD_SIZE	sizeof(unsigned long)
+#define ENCDEC_WORD_ONES	(~0UL / 0xFF)			/* 0x0101...01 */
+#define ENCDEC_WORD_LOW7	(ENCDEC_WORD_ONES * 0x7F)	/* 0x7f7f...7f */
+
+#define ENCDEC_KEY_STRIDE_MIN	512	/* the least bytes that one pass over an expanded key block covers */
+#define ENCDEC_KEY_BLOCK_SIZE(max_length)	(ENCDEC_KEY_STRIDE_MIN + 2 * (max_length))	/* room for keys up to max_length */
+
+/* returns 1 when both pointers can be moved to a word boundary by the same number of bytes */
+static inline int encdec_same_alignment(const char* dst, const char* src)
+{
+    return (((unsigned long)dst ^ (unsigned long)src) & (ENCDEC_WORD_SIZE - 1)) == 0;
+}
+
+/* dst[i] = (src[i] + shift) % 128, dst and src are the same buffer or do not overlap.
+The low 7 bits of (byte + shift) depend only on the low 7 bits of both, and two 7 bit
+values never carry into the next byte, so all the bytes of a word are added at once */
+static inline void encdec_caesar(char* dst, const char* src, size_t amount, unsigned char shift)
+{
+    unsigned long shift_word = (shift & 0x7F) * ENCDEC_WORD_ONES; /* shift in every byte of the word */
+    size_t i = 0;
+
+    if(encdec_same_alignment(dst, src))
+    {
+        for(; i < amount && ((unsigned long)(dst + i) & (ENCDEC_WORD_SIZE - 1)) != 0; i++) /* bytes till the word boundary */
+        {
+            dst[i] = (src[i] + shift) & 0x7F;
+        }
+        for(; i + ENCDEC_WORD_SIZE <= amount; i += ENCDEC_WORD_SIZE) /* whole words */
+        {
+            *(unsigned long*)(dst + i) = ((*(const unsigned long*)(src + i) & ENCDEC_WORD_LOW7) + shift_word) & ENCDEC_WORD_LOW7;
+        }
+    }
+    for(; i < amount; i++) /* the rest of the bytes */
+    {
+        dst[i] = (src[i] + shift) & 0x7F;
+    }
+}
+
+/* dst[i] = src[i] ^ key, dst and src are the same buffer or do not overlap */
+static inline void encdec_xor(char* dst, const char* src, size_t amount, unsigned char key)
+{
+    unsigned long key_word = key * ENCDEC_WORD_ONES; /* key in every byte of the word */
+    size_t i = 0;
+
+    if(encdec_same_alignment(dst, src))
+    {
+        for(; i < amount && ((unsigned long)(dst + i) & (ENCDEC_WORD_SIZE - 1)) != 0; i++) /* bytes till the word boundary */
+        {
+            dst[i] = src[i] ^ key;
+        }
+        for(; i + ENCDEC_WORD_SIZE <= amount; i += ENCDEC_WORD_SIZE) /* whole words */
+        {
+            *(unsigned long*)(dst + i) = *(const unsigned long*)(src + i) ^ key_word;
+        }
+    }
+    for(; i < amount; i++) /* the rest of the bytes */
+    {
+        dst[i] = src[i] ^ key;
+    }
+}
+
+/* dst[i] = src[i] ^ keystream[i], dst and src are as in encdec_xor, keystream has no alignment (its words are
+loaded with memcpy, which the compiler turns into one load where unaligned loads are allowed) */
+static inline void encdec_xor_stream(char* dst, const char* src, size_t amount, const unsigned char* keystream)
+{
+    unsigned long key_word;
+    size_t i = 0;
+
+    if(encdec_same_alignment(dst, src))
+    {
+        for(; i < amount && ((unsigned long)(dst + i) & (ENCDEC_WORD_SIZE - 1)) != 0; i++) /* bytes till the word boundary */
+        {
+            dst[i] = src[i] ^ keystream[i];
+        }
+        for(; i + ENCDEC_WORD_SIZE <= amount; i += ENCDEC_WORD_SIZE) /* whole words */
+        {
+            memcpy(&key_word, keystream + i, ENCDEC_WORD_SIZE);
+            *(unsigned long*)(dst + i) = *(const unsigned long*)(src + i) ^ key_word;
+        }
+    }
+    for(; i < amount; i++) /* the rest of the bytes */
+    {
+        dst[i] = src[i] ^ keystream[i];
+    }
+}
+
+/* writing the key block of a repeating key of 'length' bytes to 'block' (ENCDEC_KEY_BLOCK_SIZE(length) bytes),
+returns the stride, the block repeats the key for a stride (the smallest multiple of length that is at least
+ENCDEC_KEY_STRIDE_MIN) and one more key, so a stride of the keystream can start at any of the key's phases */
+static inline size_t encdec_expand_key(unsigned char* block, const unsigned char* key, size_t length)
+{
+    size_t stride = (ENCDEC_KEY_STRIDE_MIN + length - 1) / length * length;
+    size_t i;
+    for(i = 0; i < stride + length; i++)
+    {
+        block[i] = key[i % length];
+    }
+    return stride;
+}
+
+/* dst[i] = src[i] ^ key[(pos + i) % length], so the key lines up with the absolute offset 'pos' of src,
+block and stride come from encdec_expand_key, every stride starts at the same phase of the key */
+static inline void encdec_xor_key(char* dst, const char* src, size_t amount, unsigned long pos,
+                                  const unsigned char* block, size_t length, size_t stride)
+{
+    const unsigned char* phase = block + pos % length;
+    size_t chunk;
+    while(amount > 0)
+    {
+        chunk = (amount < stride) ? amount : stride;
+        encdec_xor_stream(dst, src, chunk, phase);
+        dst += chunk;
+        src += chunk;
+        amount -= chunk;
+    }
+}
+
+/* the shift that undoes a caesar encryption with the received key ((s - key + 128) % 128 == (s + (128 - key)) % 128) */
+static inline unsigned char encdec_caesar_inverse(unsigned char key)
+{
+    return (128 - (key & 0x7F)) & 0x7F;
+}
+
+#endif
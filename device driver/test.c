@@ -6,11 +6,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #include "encdec.h"
+#include "encdec_cipher.h"
 
 #define READ_BUFFER_SIZE 1000
-#define CMD_BUFFER_SIZE 50
+#define CMD_BUFFER_SIZE 256 /* room for batch commands */
 #define MAX_FD_COUNT 10
 
 char* delimiters = " \n\r\t";
@@ -39,7 +45,7 @@ char** parse_command(char* command, int* args_count_out)
 		    {
 				args_count++;
 				args = (char**)realloc(args, args_count * sizeof(char*));
-				args[args_count - 1] = malloc(sizeof(char) * strlen(even_token));
+				args[args_count - 1] = malloc(sizeof(char) * (strlen(even_token) + 1));
 				strcpy(args[args_count - 1], even_token);
 				even_token = strtok_r(NULL, delimiters, &save_ptr_even_token);
 		    }    		
@@ -49,7 +55,7 @@ char** parse_command(char* command, int* args_count_out)
     	{
   	        args_count++;
 	        args = (char**)realloc(args, args_count * sizeof(char*));
-	        args[args_count - 1] = malloc(sizeof(char) * strlen(token));
+	        args[args_count - 1] = malloc(sizeof(char) * (strlen(token) + 1));
 	        strcpy(args[args_count - 1], token);		
     	}
 
@@ -61,6 +67,768 @@ char** parse_command(char* command, int* args_count_out)
     return args;
 }
 
+/* the loopback stand-in for the driver (test -l <memory_size>), the devices are buffers of this process that are
+ciphered like the module does, the commands reach them through the dev_* functions below which call the real
+syscalls when the module is used, so the commands and the benchmarks run the same with and without the module.
+it covers the random access mode: open, close, read, write, lseek, pread, pwrite and the key, read state, zero,
+discard and transform ioctls */
+#define LOOPBACK_DEVICES 16
+#define LOOPBACK_FILES 256
+#define LOOPBACK_FD_BASE 1000 /* the fds of loopback files are LOOPBACK_FD_BASE + their index */
+
+typedef struct {
+	char* data; /* NULL till the device is first opened */
+	pthread_rwlock_t lock;
+} loopback_device;
+
+typedef struct {
+	int used;
+	int cipher; /* 0 caesar, 1 xor (minor % 2 like the module) */
+	loopback_device* dev;
+	unsigned char key;
+	size_t keystream_length; /* 0 when key is used */
+	size_t keystream_stride;
+	unsigned char keystream[ENCDEC_KEY_BLOCK_SIZE(ENCDEC_KEYSTREAM_MAX)];
+	int read_state;
+	off_t pos;
+} loopback_file;
+
+long loopback_size = -1; /* the memory_size of the loopback devices, -1 when the module is used */
+loopback_device loopback_devices[LOOPBACK_DEVICES];
+loopback_file loopback_files[LOOPBACK_FILES];
+pthread_mutex_t loopback_mutex = PTHREAD_MUTEX_INITIALIZER; /* protects opening and closing */
+
+loopback_file* loopback_get(int fd)
+{
+	if(fd < LOOPBACK_FD_BASE || fd >= LOOPBACK_FD_BASE + LOOPBACK_FILES || !loopback_files[fd - LOOPBACK_FD_BASE].used)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+	return &loopback_files[fd - LOOPBACK_FD_BASE];
+}
+
+int dev_open(const char* path, int flags)
+{
+	int minor;
+	int fd = -1;
+	if(loopback_size < 0)
+	{
+		return open(path, flags);
+	}
+	if(sscanf(path, "/dev/encdec%d", &minor) != 1 || minor < 0 || minor >= LOOPBACK_DEVICES)
+	{
+		errno = ENODEV;
+		return -1;
+	}
+	pthread_mutex_lock(&loopback_mutex);
+	if(loopback_devices[minor].data == NULL)
+	{
+		loopback_devices[minor].data = calloc(loopback_size + 1, 1);
+		pthread_rwlock_init(&loopback_devices[minor].lock, NULL);
+	}
+	for(int i = 0; i < LOOPBACK_FILES && fd < 0; i++)
+	{
+		if(!loopback_files[i].used)
+		{
+			loopback_files[i].used = 1;
+			loopback_files[i].cipher = minor % 2;
+			loopback_files[i].dev = &loopback_devices[minor];
+			loopback_files[i].key = 0;
+			loopback_files[i].keystream_length = 0;
+			loopback_files[i].read_state = ENCDEC_READ_STATE_DECRYPT;
+			loopback_files[i].pos = 0;
+			fd = LOOPBACK_FD_BASE + i;
+		}
+	}
+	pthread_mutex_unlock(&loopback_mutex);
+	if(fd < 0)
+	{
+		errno = EMFILE;
+	}
+	return fd;
+}
+
+int dev_close(int fd)
+{
+	loopback_file* file;
+	if(loopback_size < 0)
+	{
+		return close(fd);
+	}
+	if((file = loopback_get(fd)) == NULL)
+	{
+		return -1;
+	}
+	pthread_mutex_lock(&loopback_mutex);
+	file->used = 0;
+	pthread_mutex_unlock(&loopback_mutex);
+	return 0;
+}
+
+ssize_t dev_pread(int fd, char* buf, size_t count, off_t pos)
+{
+	loopback_file* file;
+	if(loopback_size < 0)
+	{
+		return pread(fd, buf, count, pos);
+	}
+	if((file = loopback_get(fd)) == NULL)
+	{
+		return -1;
+	}
+	if(pos >= loopback_size || count == 0 ||
+	   (file->read_state != ENCDEC_READ_STATE_RAW && file->read_state != ENCDEC_READ_STATE_DECRYPT))
+	{
+		errno = EINVAL; /* as the module */
+		return -1;
+	}
+	if(pos + count > loopback_size)
+	{
+		count = loopback_size - pos;
+	}
+	pthread_rwlock_rdlock(&file->dev->lock);
+	if(file->read_state == ENCDEC_READ_STATE_RAW)
+	{
+		memcpy(buf, file->dev->data + pos, count);
+	}
+	else if(file->cipher == 0)
+	{
+		encdec_caesar(buf, file->dev->data + pos, count, encdec_caesar_inverse(file->key));
+	}
+	else if(file->keystream_length != 0)
+	{
+		encdec_xor_key(buf, file->dev->data + pos, count, pos, file->keystream, file->keystream_length, file->keystream_stride);
+	}
+	else
+	{
+		encdec_xor(buf, file->dev->data + pos, count, file->key);
+	}
+	pthread_rwlock_unlock(&file->dev->lock);
+	return count;
+}
+
+ssize_t dev_pwrite(int fd, const char* buf, size_t count, off_t pos)
+{
+	loopback_file* file;
+	if(loopback_size < 0)
+	{
+		return pwrite(fd, buf, count, pos);
+	}
+	if((file = loopback_get(fd)) == NULL)
+	{
+		return -1;
+	}
+	if(pos >= loopback_size)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+	if(pos + count > loopback_size)
+	{
+		count = loopback_size - pos;
+	}
+	pthread_rwlock_wrlock(&file->dev->lock);
+	if(file->cipher == 0)
+	{
+		encdec_caesar(file->dev->data + pos, buf, count, file->key);
+	}
+	else if(file->keystream_length != 0)
+	{
+		encdec_xor_key(file->dev->data + pos, buf, count, pos, file->keystream, file->keystream_length, file->keystream_stride);
+	}
+	else
+	{
+		encdec_xor(file->dev->data + pos, buf, count, file->key);
+	}
+	pthread_rwlock_unlock(&file->dev->lock);
+	return count;
+}
+
+ssize_t dev_read(int fd, char* buf, size_t count)
+{
+	loopback_file* file;
+	ssize_t result;
+	if(loopback_size < 0)
+	{
+		return read(fd, buf, count);
+	}
+	if((file = loopback_get(fd)) == NULL)
+	{
+		return -1;
+	}
+	result = dev_pread(fd, buf, count, file->pos);
+	if(result > 0)
+	{
+		file->pos += result;
+	}
+	return result;
+}
+
+ssize_t dev_write(int fd, const char* buf, size_t count)
+{
+	loopback_file* file;
+	ssize_t result;
+	if(loopback_size < 0)
+	{
+		return write(fd, buf, count);
+	}
+	if((file = loopback_get(fd)) == NULL)
+	{
+		return -1;
+	}
+	result = dev_pwrite(fd, buf, count, file->pos);
+	if(result > 0)
+	{
+		file->pos += result;
+	}
+	return result;
+}
+
+off_t dev_lseek(int fd, off_t offset, int whence)
+{
+	loopback_file* file;
+	off_t pos;
+	if(loopback_size < 0)
+	{
+		return lseek(fd, offset, whence);
+	}
+	if((file = loopback_get(fd)) == NULL)
+	{
+		return -1;
+	}
+	pos = (whence == SEEK_END) ? loopback_size + offset : (whence == SEEK_CUR) ? file->pos + offset : offset;
+	if(pos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	file->pos = pos;
+	return pos;
+}
+
+int dev_ioctl(int fd, unsigned int cmd, unsigned long arg)
+{
+	loopback_file* file;
+	if(loopback_size < 0)
+	{
+		return ioctl(fd, cmd, arg);
+	}
+	if((file = loopback_get(fd)) == NULL)
+	{
+		return -1;
+	}
+	switch(cmd)
+	{
+		case ENCDEC_CMD_CHANGE_KEY:
+			file->key = arg;
+			file->keystream_length = 0;
+			return 0;
+		case ENCDEC_CMD_SET_KEYSTREAM:
+		{
+			struct encdec_keystream* keystream = (struct encdec_keystream*)arg;
+			if(file->cipher != 1 || keystream->length > ENCDEC_KEYSTREAM_MAX)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			file->keystream_length = 0;
+			if(keystream->length > 0)
+			{
+				file->keystream_stride = encdec_expand_key(file->keystream, keystream->key, keystream->length);
+				file->keystream_length = keystream->length;
+			}
+			return 0;
+		}
+		case ENCDEC_CMD_SET_READ_STATE:
+			file->read_state = arg;
+			return 0;
+		case ENCDEC_CMD_ZERO:
+		case ENCDEC_CMD_DISCARD:
+		{
+			struct encdec_range range = {0, loopback_size};
+			if(cmd == ENCDEC_CMD_DISCARD)
+			{
+				range = *(struct encdec_range*)arg;
+			}
+			if(range.offset > (unsigned long)loopback_size)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			if(range.length > loopback_size - range.offset)
+			{
+				range.length = loopback_size - range.offset;
+			}
+			pthread_rwlock_wrlock(&file->dev->lock);
+			memset(file->dev->data + range.offset, 0, range.length);
+			pthread_rwlock_unlock(&file->dev->lock);
+			return 0;
+		}
+		case ENCDEC_CMD_TRANSFORM:
+		{
+			struct encdec_transform* transform = (struct encdec_transform*)arg;
+			if(transform->direction != ENCDEC_DIRECTION_ENCRYPT && transform->direction != ENCDEC_DIRECTION_DECRYPT)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			if(file->cipher == 1)
+			{
+				encdec_xor(transform->out, transform->in, transform->length, transform->key);
+			}
+			else
+			{
+				encdec_caesar(transform->out, transform->in, transform->length, (transform->direction == ENCDEC_DIRECTION_ENCRYPT) ?
+					transform->key : encdec_caesar_inverse(transform->key));
+			}
+			return 0;
+		}
+	}
+	errno = ENOSYS; /* streams, batches and the counters need the module */
+	return -1;
+}
+
+/* the byte loops of the driver before the word kernels, kept as the reference for bench_cipher */
+void caesar_encrypt_bytes(char* s, size_t amount, unsigned int key)
+{
+	for(int i = 0; i < (int)amount; i++)
+	{
+		s[i] = (s[i] + key) % 128;
+	}
+}
+
+void caesar_decrypt_bytes(char* s, size_t amount, unsigned int key)
+{
+	for(int i = 0; i < (int)amount; i++)
+	{
+		s[i] = ((s[i] - key) + 128) % 128;
+	}
+}
+
+void xor_bytes(char* s, size_t amount, unsigned int key)
+{
+	for(int i = 0; i < (int)amount; i++)
+	{
+		s[i] = s[i] ^ key;
+	}
+}
+
+/* the byte loop of a multi-byte xor key at offset pos, the reference for encdec_xor_key */
+void xor_key_bytes(char* s, size_t amount, unsigned long pos, const unsigned char* key, size_t length)
+{
+	for(size_t i = 0; i < amount; i++)
+	{
+		s[i] = s[i] ^ key[(pos + i) % length];
+	}
+}
+
+double seconds_since(struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* runs the byte loops and the word kernels 'rounds' times over 'size' bytes, prints their MB/s and checks that their output is identical */
+int bench_cipher(int size, int rounds)
+{
+	unsigned char key = 77;
+	char* reference = malloc(size);
+	char* data = malloc(size);
+	struct timespec start;
+	double byte_time[4];
+	double word_time[4];
+	const char* names[4] = {"caesar_encrypt", "caesar_decrypt", "xor", "xor_keystream"};
+	const unsigned char stream_key[] = "0123456789abcdefghijklmnopqrstu"; /* 31 bytes so the phases move */
+	const size_t stream_length = sizeof(stream_key) - 1;
+	const unsigned long stream_pos = 5; /* an unaligned offset in the device */
+	unsigned char block[ENCDEC_KEY_BLOCK_SIZE(ENCDEC_KEYSTREAM_MAX)];
+	size_t stride = encdec_expand_key(block, stream_key, stream_length);
+	int result = 0;
+
+	if(size <= 0 || rounds <= 0 || reference == NULL || data == NULL)
+	{
+		free(reference);
+		free(data);
+		errno = EINVAL;
+		return -1;
+	}
+	for(int i = 0; i < size; i++)
+	{
+		reference[i] = data[i] = (char)(i * 131 + 7);
+	}
+
+	for(int cipher = 0; cipher < 4; cipher++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int round = 0; round < rounds; round++)
+		{
+			if(cipher == 0)
+			{
+				caesar_encrypt_bytes(reference, size, key);
+			}
+			else if(cipher == 1)
+			{
+				caesar_decrypt_bytes(reference, size, key);
+			}
+			else if(cipher == 2)
+			{
+				xor_bytes(reference, size, key);
+			}
+			else
+			{
+				xor_key_bytes(reference, size, stream_pos, stream_key, stream_length);
+			}
+		}
+		byte_time[cipher] = seconds_since(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int round = 0; round < rounds; round++)
+		{
+			if(cipher == 0)
+			{
+				encdec_caesar(data, data, size, key);
+			}
+			else if(cipher == 1)
+			{
+				encdec_caesar(data, data, size, encdec_caesar_inverse(key));
+			}
+			else if(cipher == 2)
+			{
+				encdec_xor(data, data, size, key);
+			}
+			else
+			{
+				encdec_xor_key(data, data, size, stream_pos, block, stream_length, stride);
+			}
+		}
+		word_time[cipher] = seconds_since(&start);
+
+		if(memcmp(reference, data, size) != 0)
+		{
+			printf("%s: output differs from the byte loop\n", names[cipher]);
+			result = -1;
+			errno = EIO;
+		}
+		printf("%s: bytes %.1f MB/s, words %.1f MB/s\n", names[cipher],
+			(double)size * rounds / byte_time[cipher] / 1e6, (double)size * rounds / word_time[cipher] / 1e6);
+	}
+
+	free(reference);
+	free(data);
+	return result;
+}
+
+/* one reader thread of the stress command */
+typedef struct {
+	const char* path;
+	int block;
+	volatile int* stop;
+	long long bytes; /* bytes that the thread has read */
+	int error; /* errno of the first failure or 0 */
+} stress_reader;
+
+/* reading the device with pread from its start to its end again and again till stop is set */
+void* stress_reader_task(void* arg)
+{
+	stress_reader* reader = (stress_reader*)arg;
+	char* buffer = malloc(reader->block);
+	off_t pos = 0;
+	int fd = dev_open(reader->path, O_RDONLY);
+	if(fd < 0 || buffer == NULL)
+	{
+		reader->error = (fd < 0) ? errno : ENOMEM;
+		free(buffer);
+		return NULL;
+	}
+	while(!*reader->stop)
+	{
+		ssize_t result = dev_pread(fd, buffer, reader->block, pos);
+		if(result <= 0) /* the end of the device buffer */
+		{
+			if(pos == 0)
+			{
+				reader->error = (result < 0) ? errno : EIO;
+				break;
+			}
+			pos = 0;
+			continue;
+		}
+		reader->bytes += result;
+		pos += result;
+	}
+	dev_close(fd);
+	free(buffer);
+	return NULL;
+}
+
+/* runs 1, 2, 4, ... max_threads readers on the device for 'seconds' seconds each and prints their total MB/s */
+int stress(int device, int max_threads, int seconds, int block)
+{
+	char path[32];
+	pthread_t threads[max_threads > 0 ? max_threads : 1];
+	stress_reader readers[max_threads > 0 ? max_threads : 1];
+	volatile int stop;
+
+	if(max_threads <= 0 || seconds <= 0 || block <= 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/dev/encdec%d", device);
+	for(int count = 1; count <= max_threads; count = (count * 2 > max_threads && count != max_threads) ? max_threads : count * 2)
+	{
+		long long total = 0;
+		stop = 0;
+		for(int i = 0; i < count; i++)
+		{
+			readers[i].path = path;
+			readers[i].block = block;
+			readers[i].stop = &stop;
+			readers[i].bytes = 0;
+			readers[i].error = 0;
+			pthread_create(&threads[i], NULL, stress_reader_task, &readers[i]);
+		}
+		sleep(seconds);
+		stop = 1;
+		for(int i = 0; i < count; i++)
+		{
+			pthread_join(threads[i], NULL);
+			if(readers[i].error != 0)
+			{
+				errno = readers[i].error;
+				return -1;
+			}
+			total += readers[i].bytes;
+		}
+		printf("%d readers: %.1f MB/s\n", count, total / (double)seconds / 1e6);
+	}
+	return 0;
+}
+
+/* per-call latencies are counted in a log-linear histogram (16 steps between powers of 2) so the threads
+keep no samples and the percentiles are within about 6% */
+#define LATENCY_STEPS 16
+#define LATENCY_BUCKETS (64 * LATENCY_STEPS)
+
+int latency_bucket(long long ns)
+{
+	int log = 0;
+	if(ns < LATENCY_STEPS)
+	{
+		return ns < 0 ? 0 : ns;
+	}
+	while((ns >> log) >= 2 * LATENCY_STEPS)
+	{
+		log++;
+	}
+	return (log + 1) * LATENCY_STEPS + (int)((ns >> log) - LATENCY_STEPS); /* the top 5 bits of ns */
+}
+
+long long latency_of_bucket(int bucket) /* the smallest latency of a bucket */
+{
+	int log = bucket / LATENCY_STEPS - 1;
+	if(log < 0)
+	{
+		return bucket;
+	}
+	return (long long)(LATENCY_STEPS + bucket % LATENCY_STEPS) << log;
+}
+
+/* one thread of the bench command */
+typedef struct {
+	const char* path;
+	int block;
+	int write_percent; /* of the calls that are writes */
+	int read_state;
+	volatile int* stop;
+	long long read_bytes;
+	long long written_bytes;
+	long long latency[LATENCY_BUCKETS]; /* calls by latency_bucket() of their ns */
+	int error; /* errno of the first failure or 0 */
+} bench_worker;
+
+long long nanoseconds_since(struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+/* reading and writing random blocks of the device till stop is set */
+void* bench_worker_task(void* arg)
+{
+	bench_worker* worker = (bench_worker*)arg;
+	char* buffer = malloc(worker->block);
+	unsigned int seed = (unsigned int)(size_t)worker;
+	struct timespec start;
+	off_t blocks;
+	int fd = dev_open(worker->path, worker->write_percent > 0 ? O_RDWR : O_RDONLY);
+	if(fd < 0 || buffer == NULL)
+	{
+		worker->error = (fd < 0) ? errno : ENOMEM;
+		free(buffer);
+		return NULL;
+	}
+	memset(buffer, 'a', worker->block);
+	blocks = dev_lseek(fd, 0, SEEK_END) / worker->block;
+	if(blocks <= 0 || dev_ioctl(fd, ENCDEC_CMD_CHANGE_KEY, 13) < 0 || dev_ioctl(fd, ENCDEC_CMD_SET_READ_STATE, worker->read_state) < 0)
+	{
+		worker->error = (blocks <= 0) ? EINVAL : errno;
+	}
+	while(worker->error == 0 && !*worker->stop)
+	{
+		off_t pos = (off_t)(rand_r(&seed) % blocks) * worker->block;
+		int write = (int)(rand_r(&seed) % 100) < worker->write_percent;
+		ssize_t result;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		result = write ? dev_pwrite(fd, buffer, worker->block, pos) : dev_pread(fd, buffer, worker->block, pos);
+		worker->latency[latency_bucket(nanoseconds_since(&start))]++;
+		if(result < 0)
+		{
+			worker->error = errno;
+			break;
+		}
+		if(write)
+		{
+			worker->written_bytes += result;
+		}
+		else
+		{
+			worker->read_bytes += result;
+		}
+	}
+	dev_close(fd);
+	free(buffer);
+	return NULL;
+}
+
+/* bench <device> <block> <threads> <write_percent> <raw|decrypt> <seconds>, runs the threads on random blocks of
+the device and prints the MB/s and the latency percentiles of the calls */
+int bench(int device, int block, int threads, int write_percent, int read_state, int seconds)
+{
+	static const double percentiles[] = {50, 90, 99, 99.9, 100};
+	char path[32];
+	pthread_t* ids = malloc(sizeof(pthread_t) * (threads > 0 ? threads : 1));
+	bench_worker* workers = calloc(threads > 0 ? threads : 1, sizeof(bench_worker));
+	long long latency[LATENCY_BUCKETS] = {0};
+	long long calls = 0;
+	long long read_bytes = 0;
+	long long written_bytes = 0;
+	volatile int stop = 0;
+	struct timespec start;
+	double elapsed;
+	int error = 0;
+
+	if(ids == NULL || workers == NULL || block <= 0 || threads <= 0 || seconds <= 0 || write_percent < 0 || write_percent > 100)
+	{
+		free(ids);
+		free(workers);
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/dev/encdec%d", device);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < threads; i++)
+	{
+		workers[i].path = path;
+		workers[i].block = block;
+		workers[i].write_percent = write_percent;
+		workers[i].read_state = read_state;
+		workers[i].stop = &stop;
+		pthread_create(&ids[i], NULL, bench_worker_task, &workers[i]);
+	}
+	sleep(seconds);
+	stop = 1;
+	for(int i = 0; i < threads; i++)
+	{
+		pthread_join(ids[i], NULL);
+		if(workers[i].error != 0 && error == 0)
+		{
+			error = workers[i].error;
+		}
+		read_bytes += workers[i].read_bytes;
+		written_bytes += workers[i].written_bytes;
+		for(int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+		{
+			latency[bucket] += workers[i].latency[bucket];
+			calls += workers[i].latency[bucket];
+		}
+	}
+	elapsed = seconds_since(&start);
+	free(ids);
+	free(workers);
+	if(error != 0)
+	{
+		errno = error;
+		return -1;
+	}
+
+	printf("%lld calls in %.2f s: read %.1f MB/s, write %.1f MB/s, total %.1f MB/s\n", calls, elapsed,
+		read_bytes / elapsed / 1e6, written_bytes / elapsed / 1e6, (read_bytes + written_bytes) / elapsed / 1e6);
+	for(int p = 0; p < (int)(sizeof(percentiles) / sizeof(percentiles[0])) && calls > 0; p++)
+	{
+		long long rank = (long long)(calls * percentiles[p] / 100); /* the calls that are below the percentile */
+		long long seen = 0;
+		int bucket = 0;
+		while(bucket < LATENCY_BUCKETS - 1 && seen + latency[bucket] <= rank - (percentiles[p] == 100))
+		{
+			seen += latency[bucket++];
+		}
+		printf("  p%g: %.2f us\n", percentiles[p], latency_of_bucket(bucket) / 1e3);
+	}
+	return 0;
+}
+
+int execute_command(char** args, int args_count);
+void free_parsed_command(char** args, int args_count);
+
+/* replay <trace> <rounds>, runs the commands of a trace file (one command per line like the interactive input)
+'rounds' times as fast as possible, prints the commands per second and how many of them failed */
+int replay(const char* path, int rounds)
+{
+	FILE* trace = fopen(path, "r");
+	char* line = NULL;
+	size_t capacity = 0;
+	long long commands = 0;
+	long long failures = 0;
+	struct timespec start;
+	double elapsed;
+
+	if(trace == NULL)
+	{
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int round = 0; round < rounds; round++)
+	{
+		rewind(trace);
+		while(getline(&line, &capacity, trace) > 0)
+		{
+			char** args;
+			int args_count;
+			if(strncmp(line, "exit", 4) == 0)
+			{
+				break;
+			}
+			args = parse_command(line, &args_count);
+			if(args_count > 0 && strcmp(args[0], "replay") != 0) /* no nested traces */
+			{
+				commands++;
+				failures += (execute_command(args, args_count) < 0);
+			}
+			free_parsed_command(args, args_count);
+		}
+	}
+	elapsed = seconds_since(&start);
+	free(line);
+	fclose(trace);
+	read_cmd = 0;
+	printf("%lld commands in %.3f s (%.0f per second), %lld failed\n", commands, elapsed, commands / elapsed, failures);
+	return 0;
+}
+
 int execute_command(char** args, int args_count)
 {
 	read_cmd = 0;
@@ -85,17 +853,16 @@ int execute_command(char** args, int args_count)
 			{
 				flags = O_RDWR;			
 			}
-
-			if(device == 0)
+			if(args_count > 4 && strcmp(args[4], "nonblock") == 0) /* for streams */
 			{
-				path = "/dev/encdec0";
-			}
-			else if(device == 1)
-			{
-				path = "/dev/encdec1";
+				flags |= O_NONBLOCK;
 			}
 
-			int result = open(path, flags);
+			char device_path[32];
+			snprintf(device_path, sizeof(device_path), "/dev/encdec%d", device); /* any minor up to device_count */
+			path = device_path;
+
+			int result = dev_open(path, flags);
 			if(result < 0)
 			{
 				return result;
@@ -107,7 +874,7 @@ int execute_command(char** args, int args_count)
 		else if(strcmp(args[0], "close") == 0)
 		{
 			int fd_index = atoi(args[1]);
-			int result = close(fds[fd_index]);
+			int result = dev_close(fds[fd_index]);
 			if(result < 0)
 			{
 				return result;
@@ -140,21 +907,226 @@ int execute_command(char** args, int args_count)
 					cmd_arg = ENCDEC_READ_STATE_DECRYPT;
 				}
 			}
+			else if(strcmp(args[2], "mode") == 0)
+			{
+				cmd_type = ENCDEC_CMD_SET_MODE;
+				cmd_arg = (strcmp(args[3], "stream") == 0) ? ENCDEC_MODE_STREAM : ENCDEC_MODE_RANDOM_ACCESS;
+			}
+			else if(strcmp(args[2], "keystream") == 0) /* ioctl <fd> keystream <key>, no key goes back to the single byte key */
+			{
+				struct encdec_keystream keystream;
+				memset(&keystream, 0, sizeof(keystream));
+				if(args_count > 3)
+				{
+					keystream.length = strlen(args[3]);
+					if(keystream.length > ENCDEC_KEYSTREAM_MAX)
+					{
+						errno = EINVAL;
+						return -1;
+					}
+					memcpy(keystream.key, args[3], keystream.length);
+				}
+				return dev_ioctl(fds[fd_index], ENCDEC_CMD_SET_KEYSTREAM, (unsigned long)&keystream);
+			}
+			else if(strcmp(args[2], "reset_stats") == 0)
+			{
+				cmd_type = ENCDEC_CMD_RESET_STATS;
+				cmd_arg = 0;
+			}
 			else if(strcmp(args[2], "zero") == 0)
 			{
 				cmd_type = ENCDEC_CMD_ZERO;
 				cmd_arg = 0;
 			}			
+			else if(strcmp(args[2], "discard") == 0)
+			{
+				struct encdec_range range;
+				range.offset = atol(args[3]);
+				range.length = atol(args[4]);
+				return dev_ioctl(fds[fd_index], ENCDEC_CMD_DISCARD, (unsigned long)&range);
+			}
+			else if(strcmp(args[2], "transform") == 0) /* ioctl <fd> transform <encrypt|decrypt> <key> <text> */
+			{
+				struct encdec_transform transform;
+				transform.direction = (strcmp(args[3], "decrypt") == 0) ? ENCDEC_DIRECTION_DECRYPT : ENCDEC_DIRECTION_ENCRYPT;
+				transform.key = atoi(args[4]);
+				transform.in = args[5];
+				transform.out = read_buffer;
+				transform.length = strlen(args[5]);
+				if(transform.length >= READ_BUFFER_SIZE)
+				{
+					errno = EINVAL;
+					return -1;
+				}
+				read_cmd = 1;
+				memset(read_buffer, 0, READ_BUFFER_SIZE);
+				return dev_ioctl(fds[fd_index], ENCDEC_CMD_TRANSFORM, (unsigned long)&transform);
+			}
 
-			return ioctl(fds[fd_index], cmd_type, cmd_arg);
+			return dev_ioctl(fds[fd_index], cmd_type, cmd_arg);
 		}
 		else if(strcmp(args[0], "lseek") == 0)
 		{
 			int fd_index = atoi(args[1]);
 			int pos = atoi(args[2]);
+			int whence = SEEK_SET;
 
-			return lseek(fds[fd_index], pos, SEEK_SET);
+			if(args_count > 3 && strcmp(args[3], "cur") == 0)
+			{
+				whence = SEEK_CUR;
+			}
+			else if(args_count > 3 && strcmp(args[3], "end") == 0)
+			{
+				whence = SEEK_END;
+			}
+			return dev_lseek(fds[fd_index], pos, whence);
 		}		
+		else if(strcmp(args[0], "batch") == 0) /* batch <fd> key=<k> state=<raw|decrypt> seek=<pos> read=<count> write=<text> ... */
+		{
+			int fd_index = atoi(args[1]);
+			struct encdec_batch_entry entries[ENCDEC_BATCH_MAX];
+			struct encdec_batch batch;
+			int used = 0; /* bytes of read_buffer that were given to read entries */
+			int result;
+
+			batch.entries = entries;
+			batch.count = 0;
+			for(int i = 2; i < args_count && batch.count < ENCDEC_BATCH_MAX; i++)
+			{
+				struct encdec_batch_entry* entry = &entries[batch.count++];
+				char* value = strchr(args[i], '=');
+				if(value == NULL)
+				{
+					errno = EINVAL;
+					return -1;
+				}
+				value++;
+				memset(entry, 0, sizeof(*entry));
+				if(strncmp(args[i], "key=", 4) == 0)
+				{
+					entry->cmd = ENCDEC_BATCH_CHANGE_KEY;
+					entry->arg = atoi(value);
+				}
+				else if(strncmp(args[i], "state=", 6) == 0)
+				{
+					entry->cmd = ENCDEC_BATCH_SET_READ_STATE;
+					entry->arg = (strcmp(value, "decrypt") == 0) ? ENCDEC_READ_STATE_DECRYPT : ENCDEC_READ_STATE_RAW;
+				}
+				else if(strncmp(args[i], "seek=", 5) == 0)
+				{
+					entry->cmd = ENCDEC_BATCH_SEEK;
+					entry->arg = atol(value);
+				}
+				else if(strncmp(args[i], "read=", 5) == 0)
+				{
+					entry->cmd = ENCDEC_BATCH_READ;
+					entry->count = atoi(value);
+					if(used + entry->count + 1 >= READ_BUFFER_SIZE)
+					{
+						errno = EINVAL;
+						return -1;
+					}
+					entry->buf = read_buffer + used;
+					used += entry->count + 1;
+				}
+				else if(strncmp(args[i], "write=", 6) == 0)
+				{
+					entry->cmd = ENCDEC_BATCH_WRITE;
+					entry->buf = value;
+					entry->count = strlen(value);
+				}
+				else
+				{
+					errno = EINVAL;
+					return -1;
+				}
+			}
+			read_cmd = 1;
+			memset(read_buffer, 0, READ_BUFFER_SIZE);
+			result = ioctl(fds[fd_index], ENCDEC_CMD_BATCH, &batch);
+			for(int i = 0; i < result; i++)
+			{
+				printf("entry %d: %ld\n", i, entries[i].result);
+				if(entries[i].cmd == ENCDEC_BATCH_READ)
+				{
+					entries[i].buf[entries[i].count] = '|';
+				}
+			}
+			return result;
+		}
+		else if(strcmp(args[0], "poll") == 0) /* poll <fd> <timeout_ms>, prints which of read/write are ready */
+		{
+			struct pollfd pfd;
+			int result;
+
+			pfd.fd = fds[atoi(args[1])];
+			pfd.events = POLLIN | POLLOUT;
+			result = poll(&pfd, 1, atoi(args[2]));
+			if(result < 0)
+			{
+				return result;
+			}
+			read_cmd = 1;
+			memset(read_buffer, 0, READ_BUFFER_SIZE);
+			snprintf(read_buffer, READ_BUFFER_SIZE, "%s%s", (pfd.revents & POLLIN) ? "read " : "",
+			         (pfd.revents & POLLOUT) ? "write" : "");
+			return 0;
+		}
+		else if(strcmp(args[0], "stats") == 0) /* the counters of the driver */
+		{
+			FILE* proc = fopen("/proc/encdec", "r");
+			char line[READ_BUFFER_SIZE];
+			if(proc == NULL)
+			{
+				return -1;
+			}
+			while(fgets(line, sizeof(line), proc) != NULL)
+			{
+				fputs(line, stdout);
+			}
+			fclose(proc);
+			return 0;
+		}
+		else if(strcmp(args[0], "pread") == 0)
+		{
+			int fd_index = atoi(args[1]);
+			int pos = atoi(args[2]);
+			int count = atoi(args[3]);
+
+			read_cmd = 1;
+			memset(read_buffer, 0, READ_BUFFER_SIZE);
+			return dev_pread(fds[fd_index], read_buffer, count, pos);
+		}
+		else if(strcmp(args[0], "readv") == 0) /* readv <fd> <count> <count> ..., the segments are printed with '|' between them */
+		{
+			int fd_index = atoi(args[1]);
+			struct iovec iov[MAX_FD_COUNT];
+			int segments = 0;
+			int used = 0;
+			int result;
+
+			read_cmd = 1;
+			memset(read_buffer, 0, READ_BUFFER_SIZE);
+			for(int i = 2; i < args_count && segments < MAX_FD_COUNT; i++)
+			{
+				int count = atoi(args[i]);
+				if(count < 0 || used + count + 1 >= READ_BUFFER_SIZE)
+				{
+					errno = EINVAL;
+					return -1;
+				}
+				iov[segments].iov_base = read_buffer + used;
+				iov[segments].iov_len = count;
+				used += count + 1;
+				segments++;
+			}
+			result = readv(fds[fd_index], iov, segments);
+			for(int i = 0; i + 1 < segments; i++)
+			{
+				((char*)iov[i].iov_base)[iov[i].iov_len] = '|';
+			}
+			return result;
+		}
 		else if(strcmp(args[0], "read") == 0)
 		{
 			int fd_index = atoi(args[1]);
@@ -162,14 +1134,68 @@ int execute_command(char** args, int args_count)
 
 			read_cmd = 1;
 			memset(read_buffer, 0, READ_BUFFER_SIZE);
-			return read(fds[fd_index], read_buffer, count);
+			return dev_read(fds[fd_index], read_buffer, count);
 		}		
 		else if(strcmp(args[0], "write") == 0)
 		{
 			int fd_index = atoi(args[1]);
 			char* buffer = args[2];
-			return write(fds[fd_index], buffer, strlen(buffer));
-		}	
+			return dev_write(fds[fd_index], buffer, strlen(buffer));
+		}
+		else if(strcmp(args[0], "mmap_read") == 0)
+		{
+			int fd_index = atoi(args[1]);
+			int pos = atoi(args[2]);
+			int count = atoi(args[3]);
+			long page_size = sysconf(_SC_PAGESIZE);
+			off_t map_start = pos - pos % page_size; /* mappings start on a page */
+			char* map;
+
+			if(count < 0 || count >= READ_BUFFER_SIZE)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			map = mmap(NULL, pos - map_start + count, PROT_READ, MAP_SHARED, fds[fd_index], map_start);
+			if(map == MAP_FAILED)
+			{
+				return -1;
+			}
+			read_cmd = 1;
+			memset(read_buffer, 0, READ_BUFFER_SIZE);
+			memcpy(read_buffer, map + (pos - map_start), count);
+			munmap(map, pos - map_start + count);
+			return count;
+		}
+		else if(strcmp(args[0], "bench_cipher") == 0)
+		{
+			int size = atoi(args[1]);
+			int rounds = atoi(args[2]);
+			return bench_cipher(size, rounds);
+		}
+		else if(strcmp(args[0], "stress") == 0)
+		{
+			int device = atoi(args[1]);
+			int max_threads = atoi(args[2]);
+			int seconds = atoi(args[3]);
+			int block = atoi(args[4]);
+			return stress(device, max_threads, seconds, block);
+		}
+		else if(strcmp(args[0], "bench") == 0)
+		{
+			int device = atoi(args[1]);
+			int block = atoi(args[2]);
+			int threads = atoi(args[3]);
+			int write_percent = atoi(args[4]);
+			int read_state = (strcmp(args[5], "raw") == 0) ? ENCDEC_READ_STATE_RAW : ENCDEC_READ_STATE_DECRYPT;
+			int seconds = atoi(args[6]);
+			return bench(device, block, threads, write_percent, read_state, seconds);
+		}
+		else if(strcmp(args[0], "replay") == 0)
+		{
+			int rounds = (args_count > 2) ? atoi(args[2]) : 1;
+			return replay(args[1], rounds);
+		}
 	}
 
 	return 0;
@@ -194,10 +1220,22 @@ void free_parsed_command(char** args, int args_count)
 int main(int argc, const char** argv)
 {
     memset(fds, -1, MAX_FD_COUNT * sizeof(int));
+    if(argc == 3 && strcmp(argv[1], "-l") == 0) /* test -l <memory_size> runs on the loopback devices */
+    {
+        loopback_size = atol(argv[2]);
+        if(loopback_size <= 0)
+        {
+            fprintf(stderr, "usage: %s [-l memory_size]\n", argv[0]);
+            return 1;
+        }
+    }
     while (1)
     {
         memset(command, 0, CMD_BUFFER_SIZE);
-        fgets(command, CMD_BUFFER_SIZE, stdin);
+        if(fgets(command, CMD_BUFFER_SIZE, stdin) == NULL)
+        {
+            break;
+        }
         if(strncmp(command, "exit", 4) == 0)
         {
             break;
@@ -1,133 +1,1793 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <ctype.h>
 
-#define BUFFER_SIZE 100
+#define ARGV_INITIAL_SIZE 16 /* cells of a new argv, it grows as needed */
+#define SERVER_BUFFER_SIZE 4096 /* initial receive buffer of a server client, it grows as needed */
+#define HISTORY_CAPACITY 1000 /* max number of commands in the history */
+#define HISTORY_ARENA_SIZE (64 * 1024) /* bytes for the text of the commands in the history */
+#define HISTORY_FLUSH_BATCH 16 /* commands that are written together to the history file */
+#define HISTORY_FILE_MAX_SIZE (4 * 1024 * 1024) /* size of the history file that starts a compaction */
+#define HISTORY_FILE_KEEP 10000 /* lines that are left in the history file after a compaction */
+#define STATS_BUCKETS 32 /* buckets of the duration histograms (up to about 35 minutes) */
+#define BATCH_WINDOW_FACTOR 4 /* a batch runs at most this many times -j lines ahead of the oldest unprinted line */
+#define SERVER_EVENTS 64 /* max events that the server handles in one epoll_wait */
 
-int main(void)
+extern char **environ;
+
+int run_command(char **argv, int background, struct rusage *usage, long long *wall_us);
+
+/* command that runs inside the shell process (without fork and exec), func returns the exit status */
+typedef struct {
+    const char *name;
+    int (*func)(char **argv);
+    int shared_state; /* 1 when it changes the directory or environment of the shell, which all the clients of the server share */
+} builtin_command;
+
+/* argv that grows as needed, it is reused for all the commands so no argument is allocated by itself */
+typedef struct {
+    char **argv;
+    int size; /* number of cells in argv */
+} arg_vector;
+
+/* one line of a batch script, its output is kept aside till all the previous lines were printed */
+typedef struct {
+    pid_t pid; /* the child process running the line (0 for a builtin, it is done once it is started) */
+    FILE *output; /* temporary file that holds the stdout and stderr of the line */
+    int status; /* exit status of the child */
+    int done; /* 1 when the child has finished */
+    struct timespec started; /* when the line was started */
+} batch_job;
+
+/* the history keeps the last HISTORY_CAPACITY commands, their text is bump-allocated in a circular
+arena so the memory of the history never grows, when the arena or the ring is full the oldest commands are dropped */
+typedef struct {
+    char arena[HISTORY_ARENA_SIZE]; /* the text of the commands */
+    int arena_head; /* where the next command is allocated in the arena */
+    int offsets[HISTORY_CAPACITY]; /* arena offset of every command in the ring (by its slot) */
+    int index[HISTORY_CAPACITY]; /* slots of the commands sorted by their text (and by their number for equal texts) */
+    long first; /* number of the oldest command in the ring (numbering starts from 1) */
+    int count; /* number of commands in the ring */
+} history_ring;
+
+history_ring history = {.first = 1};
+
+/* returns the text of the command with the received number, the number must be in the ring */
+const char *history_get(long number)
+{
+    return history.arena + history.offsets[(number - 1) % HISTORY_CAPACITY];
+}
+
+/* returns the number of the command that is stored in the received slot */
+long history_number(int slot)
+{
+    long first_slot = (history.first - 1) % HISTORY_CAPACITY;
+    return history.first + (slot - first_slot + HISTORY_CAPACITY) % HISTORY_CAPACITY;
+}
+
+/* returns the first position in the sorted index whose command is not smaller than (text, number) */
+int history_lower_bound(const char *text, long number)
+{
+    int low = 0;
+    int high = history.count;
+    int middle;
+    int cmp;
+    while(low < high) /* binary search */
+    {
+        middle = (low + high) / 2;
+        cmp = strcmp(history.arena + history.offsets[history.index[middle]], text);
+        if(cmp < 0 || (cmp == 0 && history_number(history.index[middle]) < number))
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/* removing the oldest command from the ring and from the index */
+void history_drop_oldest(void)
+{
+    int position = history_lower_bound(history_get(history.first), history.first);
+    memmove(&history.index[position], &history.index[position + 1], (history.count - position - 1) * sizeof(int));
+    history.first++;
+    history.count--;
+}
+
+/* adding the received command to the history, commands that are longer than the arena are not saved */
+void history_add(const char *command)
+{
+    int size = strlen(command) + 1; /* bytes to allocate in the arena */
+    int start = history.arena_head; /* where the command will be allocated */
+    int needed; /* the arena bytes that the allocation takes from arena_head (including the skipped end of the arena) */
+    int position;
+    int slot;
+    long number;
+    if(size > HISTORY_ARENA_SIZE)
+    {
+        return;
+    }
+    if(start + size > HISTORY_ARENA_SIZE) /* not enough space till the end of the arena, allocating from the beginning */
+    {
+        start = 0;
+    }
+    needed = (start == 0) ? (HISTORY_ARENA_SIZE - history.arena_head) % HISTORY_ARENA_SIZE + size : size;
+    
+    /* dropping the oldest commands while the ring is full or their text is in the area we allocate */
+    while(history.count > 0 && (history.count == HISTORY_CAPACITY ||
+          (history.offsets[(history.first - 1) % HISTORY_CAPACITY] - history.arena_head + HISTORY_ARENA_SIZE) % HISTORY_ARENA_SIZE < needed))
+    {
+        history_drop_oldest();
+    }
+    if(history.count == 0) /* the arena is empty, starting over from its beginning */
+    {
+        start = 0;
+    }
+    
+    number = history.first + history.count;
+    slot = (number - 1) % HISTORY_CAPACITY;
+    memcpy(history.arena + start, command, size);
+    history.offsets[slot] = start;
+    history.arena_head = (start + size) % HISTORY_ARENA_SIZE;
+    
+    position = history_lower_bound(command, number); /* keeping the index sorted */
+    memmove(&history.index[position + 1], &history.index[position], (history.count - position) * sizeof(int));
+    history.index[position] = slot;
+    history.count++;
+}
+
+/* returns the number of the newest command that starts with the received prefix or 0 if there is no such command */
+long history_find_prefix(const char *prefix)
+{
+    int length = strlen(prefix);
+    int position = history_lower_bound(prefix, 0); /* the first command in the index that can start with prefix */
+    long number;
+    long newest = 0;
+    while(position < history.count && strncmp(history.arena + history.offsets[history.index[position]], prefix, length) == 0)
+    {
+        number = history_number(history.index[position]);
+        if(number > newest)
+        {
+            newest = number;
+        }
+        position++;
+    }
+    return newest;
+}
+
+/* function that expands "!!", "!n" and "!prefix" to a command from the history,
+returns the text of the command or NULL if there is no such command */
+const char *history_expand(const char *command)
+{
+    char *end;
+    long number = 0;
+    if(command[1] == '!') /* the last command */
+    {
+        number = history.first + history.count - 1;
+    }
+    else if(command[1] >= '0' && command[1] <= '9') /* command by its number */
+    {
+        number = strtol(command + 1, &end, 10);
+        if(*end != '\0')
+        {
+            return NULL;
+        }
+    }
+    else if(command[1] != '\0') /* the newest command that starts with the prefix */
+    {
+        number = history_find_prefix(command + 1);
+    }
+    if(number < history.first || number >= history.first + history.count)
+    {
+        return NULL;
+    }
+    return history_get(number);
+}
+
+/* the commands that were not written to the history file yet */
+char history_pending[HISTORY_ARENA_SIZE]; /* (so every command that fits in the history fits here too) */
+int history_pending_size = 0; /* bytes in history_pending */
+int history_pending_count = 0; /* commands in history_pending */
+
+/* returns the path of the history file ($MYSHELL_HISTFILE or ~/.myshell_history) or NULL if there is no such path */
+const char *history_file_path(void)
+{
+    static char path[PATH_MAX];
+    const char *home;
+    if(getenv("MYSHELL_HISTFILE") != NULL)
+    {
+        return getenv("MYSHELL_HISTFILE");
+    }
+    home = getenv("HOME");
+    if(home == NULL || snprintf(path, sizeof(path), "%s/.myshell_history", home) >= (int)sizeof(path))
+    {
+        return NULL;
+    }
+    return path;
+}
+
+/* returns a pointer to the beginning of the last 'lines' lines of the received data (a last line without '\n' is counted too) */
+const char *history_file_tail(const char *data, size_t size, int lines)
+{
+    const char *end = data + size; /* end of the part that was not scanned yet */
+    const char *newline;
+    if(size > 0 && data[size - 1] == '\n')
+    {
+        end--; /* the '\n' of the last line */
+    }
+    while(lines > 0)
+    {
+        newline = memrchr(data, '\n', end - data); /* the end of the previous line */
+        if(newline == NULL)
+        {
+            return data;
+        }
+        end = newline;
+        lines--;
+    }
+    return end + 1;
+}
+
+/* loading the last commands of the history file into the history, only the end of the file is read so even huge files load fast */
+void history_load(void)
+{
+    struct stat st;
+    const char *path = history_file_path();
+    const char *data;
+    const char *line;
+    const char *end;
+    static char command[HISTORY_ARENA_SIZE];
+    size_t length;
+    int fd;
+    if(path == NULL || (fd = open(path, O_RDONLY)) < 0)
+    {
+        return; /* no history file yet */
+    }
+    flock(fd, LOCK_SH); /* so no other shell writes to the file while we read it */
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED)
+        {
+            line = history_file_tail(data, st.st_size, HISTORY_CAPACITY);
+            while(line < data + st.st_size) /* adding the lines from the oldest to the newest */
+            {
+                end = memchr(line, '\n', data + st.st_size - line);
+                if(end == NULL)
+                {
+                    end = data + st.st_size;
+                }
+                length = end - line;
+                if(length > 0 && length < HISTORY_ARENA_SIZE)
+                {
+                    memcpy(command, line, length);
+                    command[length] = '\0';
+                    history_add(command);
+                }
+                line = end + 1;
+            }
+            munmap((void*)data, st.st_size);
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/* opening the history file for appending and locking it, if the file was replaced by a compaction while
+we waited for the lock the new file is opened, returns the locked file descriptor or -1 */
+int history_file_lock(const char *path)
+{
+    struct stat fd_st;
+    struct stat path_st;
+    int fd;
+    while(1)
+    {
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+        if(fd < 0)
+        {
+            return -1;
+        }
+        flock(fd, LOCK_EX);
+        if(fstat(fd, &fd_st) == 0 && stat(path, &path_st) == 0 && fd_st.st_ino == path_st.st_ino && fd_st.st_dev == path_st.st_dev)
+        {
+            return fd; /* still the current history file */
+        }
+        close(fd); /* the lock is released with the file */
+    }
+}
+
+/* rewriting the history file with its last HISTORY_FILE_KEEP lines, runs in a background process */
+void history_compact(const char *path)
+{
+    char temp_path[PATH_MAX];
+    struct stat st;
+    const char *data;
+    const char *tail;
+    int temp_fd;
+    int read_fd;
+    int fd = history_file_lock(path);
+    if(fd < 0)
+    {
+        return;
+    }
+    read_fd = open(path, O_RDONLY); /* the locked descriptor is write only */
+    if(read_fd >= 0 && fstat(read_fd, &st) == 0 && st.st_size > HISTORY_FILE_MAX_SIZE && snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid()) < (int)sizeof(temp_path))
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, read_fd, 0);
+        if(data != MAP_FAILED)
+        {
+            tail = history_file_tail(data, st.st_size, HISTORY_FILE_KEEP);
+            temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if(temp_fd >= 0)
+            {
+                /* the other shells wait for our lock and then append to the new file */
+                if(write(temp_fd, tail, data + st.st_size - tail) == data + st.st_size - tail && fsync(temp_fd) == 0)
+                {
+                    rename(temp_path, path);
+                }
+                else
+                {
+                    unlink(temp_path);
+                }
+                close(temp_fd);
+            }
+            munmap((void*)data, st.st_size);
+        }
+    }
+    if(read_fd >= 0)
+    {
+        close(read_fd);
+    }
+    close(fd);
+}
+
+/* writing the pending commands to the history file with one append, the file is compacted in the background when it grows over HISTORY_FILE_MAX_SIZE */
+void history_flush(void)
+{
+    struct stat st;
+    const char *path = history_file_path();
+    pid_t pid;
+    int fd;
+    if(history_pending_size == 0 || path == NULL)
+    {
+        return;
+    }
+    fd = history_file_lock(path);
+    if(fd < 0)
+    {
+        return;
+    }
+    if(write(fd, history_pending, history_pending_size) < 0) /* one write so the commands of other shells are not mixed with ours */
+    {
+        perror("error");
+    }
+    history_pending_size = 0;
+    history_pending_count = 0;
+    if(fstat(fd, &st) != 0)
+    {
+        st.st_size = 0;
+    }
+    close(fd); /* releasing the lock before the compaction process is created so it will not inherit it */
+    
+    if(st.st_size > HISTORY_FILE_MAX_SIZE)
+    {
+        pid = fork();
+        if(pid == 0) /* the child starts the compaction in a grandchild so no one has to wait for it */
+        {
+            if(fork() == 0)
+            {
+                history_compact(path);
+            }
+            _exit(0); /* both the child and the grandchild */
+        }
+        else if(pid > 0)
+        {
+            waitpid(pid, NULL, 0);
+        }
+    }
+}
+
+/* adding the received command to the commands that will be written to the history file */
+void history_save(const char *command)
+{
+    int size = strlen(command);
+    if(history_pending_size + size + 1 > (int)sizeof(history_pending))
+    {
+        history_flush(); /* no room for the command */
+    }
+    if(size + 1 > (int)sizeof(history_pending))
+    {
+        return;
+    }
+    memcpy(history_pending + history_pending_size, command, size);
+    history_pending[history_pending_size + size] = '\n';
+    history_pending_size += size + 1;
+    history_pending_count++;
+    if(history_pending_count == HISTORY_FLUSH_BATCH)
+    {
+        history_flush();
+    }
+}
+
+/* comparing function for sorting command numbers from the newest to the oldest */
+int compare_numbers_desc(const void *a, const void *b)
+{
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return (x < y) - (x > y);
+}
+
+/* printing the history from the newest command to the oldest, with an argument printing only the commands that start with it */
+int builtin_history(char **argv)
+{
+    long numbers[HISTORY_CAPACITY]; /* numbers of the commands that match the prefix */
+    static char prefix[HISTORY_ARENA_SIZE]; /* the arguments joined by spaces */
+    int found = 0;
+    int position;
+    long i;
+    if(argv[1] == NULL)
+    {
+        for(i = history.first + history.count - 1; i >= history.first; i--)
+        {
+            fprintf(stdout, "%ld %s\n", i, history_get(i));
+        }
+        return 0;
+    }
+    
+    prefix[0] = '\0';
+    for(i = 1; argv[i] != NULL; i++)
+    {
+        if(i > 1)
+        {
+            strncat(prefix, " ", sizeof(prefix) - strlen(prefix) - 1);
+        }
+        strncat(prefix, argv[i], sizeof(prefix) - strlen(prefix) - 1);
+    }
+    position = history_lower_bound(prefix, 0); /* the matching commands are adjacent in the index */
+    while(position < history.count && strncmp(history.arena + history.offsets[history.index[position]], prefix, strlen(prefix)) == 0)
+    {
+        numbers[found++] = history_number(history.index[position++]);
+    }
+    qsort(numbers, found, sizeof(long), compare_numbers_desc);
+    for(position = 0; position < found; position++)
+    {
+        fprintf(stdout, "%ld %s\n", numbers[position], history_get(numbers[position]));
+    }
+    return 0;
+}
+
+/* histogram of durations in microseconds, bucket i counts the durations in [2^(i-1), 2^i) */
+typedef struct {
+    unsigned long buckets[STATS_BUCKETS];
+    unsigned long count; /* number of recorded durations */
+    long long total_us; /* sum of the recorded durations */
+    long long max_us; /* the longest recorded duration */
+} histogram;
+
+/* resources of all the commands that the shell has run */
+typedef struct {
+    histogram spawn_latency; /* from fork() till the child called exec */
+    histogram runtime; /* wall time of the commands */
+    struct timeval user_time; /* total user CPU time */
+    struct timeval system_time; /* total system CPU time */
+    long max_rss; /* the largest max RSS of a command in kB */
+    long voluntary_switches; /* total voluntary context switches */
+    long involuntary_switches; /* total involuntary context switches */
+} shell_stats;
+
+shell_stats stats;
+
+/* returns the microseconds that passed since the received time */
+long long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* adding the received duration to the histogram */
+void histogram_add(histogram *h, long long us)
+{
+    int bucket = 0;
+    while(bucket < STATS_BUCKETS - 1 && (1LL << bucket) <= us) /* the bucket is the number of bits of us */
+    {
+        bucket++;
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    h->total_us += us;
+    if(us > h->max_us)
+    {
+        h->max_us = us;
+    }
+}
+
+/* printing the received histogram, only the buckets that are not empty */
+void histogram_print(const char *name, const histogram *h)
+{
+    int i;
+    fprintf(stdout, "%s: %lu commands, avg %lld us, max %lld us\n", name, h->count, (h->count > 0) ? h->total_us / (long long)h->count : 0, h->max_us);
+    for(i = 0; i < STATS_BUCKETS; i++)
+    {
+        if(h->buckets[i] > 0)
+        {
+            fprintf(stdout, "  [%lld, %lld) us: %lu\n", (i == 0) ? 0 : (1LL << (i - 1)), 1LL << i, h->buckets[i]);
+        }
+    }
+}
+
+/* adding the resources of a finished command to the statistics */
+void stats_record_command(long long wall_us, const struct rusage *usage)
+{
+    histogram_add(&stats.runtime, wall_us);
+    timeradd(&stats.user_time, &usage->ru_utime, &stats.user_time);
+    timeradd(&stats.system_time, &usage->ru_stime, &stats.system_time);
+    if(usage->ru_maxrss > stats.max_rss)
+    {
+        stats.max_rss = usage->ru_maxrss;
+    }
+    stats.voluntary_switches += usage->ru_nvcsw;
+    stats.involuntary_switches += usage->ru_nivcsw;
+}
+
+/* printing the statistics of all the commands, "stats reset" clears them */
+int builtin_stats(char **argv)
+{
+    if(argv[1] != NULL && strcmp(argv[1], "reset") == 0)
+    {
+        memset(&stats, 0, sizeof(stats));
+        return 0;
+    }
+    histogram_print("spawn latency", &stats.spawn_latency);
+    histogram_print("runtime", &stats.runtime);
+    fprintf(stdout, "user %ld.%06lds sys %ld.%06lds max rss %ld kB context switches %ld voluntary %ld involuntary\n",
+            (long)stats.user_time.tv_sec, (long)stats.user_time.tv_usec, (long)stats.system_time.tv_sec, (long)stats.system_time.tv_usec,
+            stats.max_rss, stats.voluntary_switches, stats.involuntary_switches);
+    return 0;
+}
+
+/* function that writes the resources that a finished command used to out, returns its length */
+int format_usage(char *out, size_t size, long long wall_us, const struct rusage *usage)
+{
+    return snprintf(out, size, "real %lld.%06llds user %ld.%06lds sys %ld.%06lds max rss %ld kB context switches %ld/%ld",
+                    wall_us / 1000000, wall_us % 1000000, (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec,
+                    (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec, usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+/* running the rest of the arguments as a command and printing its resources */
+int builtin_time(char **argv)
+{
+    struct rusage usage;
+    long long wall_us;
+    char report[256];
+    int status;
+    if(argv[1] == NULL)
+    {
+        return 0;
+    }
+    status = run_command(argv + 1, 0, &usage, &wall_us);
+    format_usage(report, sizeof(report), wall_us, &usage);
+    fprintf(stdout, "%s\n", report);
+    return status;
+}
+
+/* changing the working directory of the shell, without an argument going to HOME */
+int builtin_cd(char **argv)
+{
+    const char *dir = (argv[1] != NULL) ? argv[1] : getenv("HOME");
+    if(dir == NULL || chdir(dir) != 0)
+    {
+        perror("error");
+        return 1;
+    }
+    return 0;
+}
+
+/* printing the working directory */
+int builtin_pwd(char **argv)
+{
+    char cwd[PATH_MAX];
+    if(getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        perror("error");
+        return 1;
+    }
+    fprintf(stdout, "%s\n", cwd);
+    return 0;
+}
+
+/* function that prints the received argument of echo -e with its backslash escapes replaced,
+returns 0 if the output should stop (\c) and 1 otherwise */
+int echo_escaped(const char *text)
+{
+    const char *escapes = "a\ab\be\033f\fn\nr\rt\tv\v\\\\"; /* pairs of an escape letter and its char */
+    const char *found;
+    int value;
+    int digits;
+    while(*text != '\0')
+    {
+        if(*text != '\\' || text[1] == '\0')
+        {
+            fputc(*text++, stdout);
+            continue;
+        }
+        text++; /* the char after the backslash */
+        if(*text == 'c')
+        {
+            return 0;
+        }
+        if(*text == '0') /* \0nnn, up to 3 octal digits */
+        {
+            value = 0;
+            for(digits = 0, text++; digits < 3 && *text >= '0' && *text <= '7'; digits++, text++)
+            {
+                value = value * 8 + (*text - '0');
+            }
+            fputc(value, stdout);
+            continue;
+        }
+        if(*text == 'x' && isxdigit((unsigned char)text[1])) /* \xHH, up to 2 hex digits */
+        {
+            value = 0;
+            for(digits = 0, text++; digits < 2 && isxdigit((unsigned char)*text); digits++, text++)
+            {
+                value = value * 16 + (isdigit((unsigned char)*text) ? *text - '0' : tolower((unsigned char)*text) - 'a' + 10);
+            }
+            fputc(value, stdout);
+            continue;
+        }
+        found = NULL;
+        for(value = 0; escapes[value] != '\0'; value += 2)
+        {
+            if(escapes[value] == *text)
+            {
+                found = &escapes[value + 1];
+                break;
+            }
+        }
+        if(found != NULL)
+        {
+            fputc(*found, stdout);
+        }
+        else /* not an escape, printed as is */
+        {
+            fputc('\\', stdout);
+            fputc(*text, stdout);
+        }
+        text++;
+    }
+    return 1;
+}
+
+/* printing the arguments separated by spaces, like /bin/echo the leading arguments that are made of
+the options n (no newline at the end), e (backslash escapes) and E (no backslash escapes) are options */
+int builtin_echo(char **argv)
+{
+    int newline = 1;
+    int escapes = 0;
+    int first;
+    int i;
+    const char *option;
+    for(i = 1; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+    {
+        for(option = argv[i] + 1; *option == 'n' || *option == 'e' || *option == 'E'; option++);
+        if(*option != '\0') /* not an option, printed as an argument */
+        {
+            break;
+        }
+        for(option = argv[i] + 1; *option != '\0'; option++)
+        {
+            if(*option == 'n')
+            {
+                newline = 0;
+            }
+            else
+            {
+                escapes = (*option == 'e');
+            }
+        }
+    }
+    for(first = i; argv[i] != NULL; i++)
+    {
+        if(i > first)
+        {
+            fputc(' ', stdout);
+        }
+        if(escapes == 0)
+        {
+            fputs(argv[i], stdout);
+        }
+        else if(echo_escaped(argv[i]) == 0) /* \c stops the output (and the newline) */
+        {
+            return 0;
+        }
+    }
+    if(newline)
+    {
+        fputc('\n', stdout);
+    }
+    return 0;
+}
+
+int builtin_true(char **argv)
+{
+    return 0;
+}
+
+int builtin_false(char **argv)
+{
+    return 1;
+}
+
+/* setting environment variables from NAME=VALUE arguments (inherited by the next commands), without arguments printing the environment */
+int builtin_export(char **argv)
+{
+    int i;
+    char *value;
+    if(argv[1] == NULL)
+    {
+        for(i = 0; environ[i] != NULL; i++)
+        {
+            fprintf(stdout, "%s\n", environ[i]);
+        }
+        return 0;
+    }
+    for(i = 1; argv[i] != NULL; i++)
+    {
+        value = strchr(argv[i], '=');
+        if(value == NULL) /* a NAME without a value is already exported */
+        {
+            continue;
+        }
+        *value = '\0'; /* splitting NAME and VALUE */
+        if(setenv(argv[i], value + 1, 1) != 0)
+        {
+            *value = '=';
+            perror("error");
+            return 1;
+        }
+        *value = '=';
+    }
+    return 0;
+}
+
+/* the builtins table, it is checked before fork() for every command */
+const builtin_command builtins[] = {
+    {"cd", builtin_cd, 1},
+    {"pwd", builtin_pwd, 0},
+    {"echo", builtin_echo, 0},
+    {"true", builtin_true, 0},
+    {"false", builtin_false, 0},
+    {"export", builtin_export, 1},
+    {"history", builtin_history, 0},
+    {"stats", builtin_stats, 0},
+    {"time", builtin_time, 0},
+    {NULL, NULL, 0}
+};
+
+/* function that returns the builtin with the received name or NULL if there is no such builtin */
+const builtin_command *find_builtin(const char *name)
+{
+    int i;
+    for(i = 0; builtins[i].name != NULL; i++)
+    {
+        if(strcmp(builtins[i].name, name) == 0)
+        {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/* function that splits the received command in place into args: spaces and tabs separate the arguments,
+'...' keeps its text as is, "..." keeps its text but \" and \\, and outside the quotes \ escapes the next char,
+when background is not NULL a last unquoted & (after another argument) is removed and *background is set to 1 (0 otherwise),
+returns the number of arguments (the cell after the last argument is NULL) or -1 if the command is not valid */
+int parse_command(char *command, arg_vector *args, int *background)
+{
+    char *in = command; /* the next char to scan */
+    char *out = command; /* where the next char of the current argument is written (never after in) */
+    char quote = 0; /* the quote we are inside of, 0 outside the quotes */
+    int in_argument = 0; /* 1 while we are inside an argument */
+    int literal = 0; /* 1 when the current argument has quotes or escapes, so its text is not an operator */
+    int argc = 0;
+    char **temp;
+    char c;
+    
+    while(1)
+    {
+        c = *in;
+        if(quote == 0 && (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\0')) /* end of an argument */
+        {
+            if(in_argument == 1)
+            {
+                *out++ = '\0';
+                in_argument = 0;
+            }
+            if(c == '\0')
+            {
+                break;
+            }
+            in++;
+            continue;
+        }
+        if(c == '\0') /* the quote was not closed */
+        {
+            fprintf(stdout, "error: unterminated quote\n");
+            return -1;
+        }
+        
+        if(in_argument == 0) /* a new argument starts here */
+        {
+            if(argc + 2 > args->size) /* keeping a cell for the NULL */
+            {
+                temp = (char**)realloc(args->argv, ((args->size == 0) ? ARGV_INITIAL_SIZE : args->size * 2) * sizeof(char*));
+                if(temp == NULL)
+                {
+                    perror("error");
+                    return -1;
+                }
+                args->argv = temp;
+                args->size = (args->size == 0) ? ARGV_INITIAL_SIZE : args->size * 2;
+            }
+            args->argv[argc++] = out;
+            in_argument = 1;
+            literal = 0;
+        }
+        
+        if(quote == 0 && (c == '\'' || c == '"')) /* opening quote */
+        {
+            quote = c;
+            literal = 1;
+        }
+        else if(quote != 0 && c == quote) /* closing quote */
+        {
+            quote = 0;
+        }
+        else
+        {
+            if(c == '\\' && in[1] != '\0' && (quote == 0 || (quote == '"' && (in[1] == '"' || in[1] == '\\'))))
+            {
+                c = *++in; /* the escaped char */
+                literal = 1;
+            }
+            *out++ = c;
+        }
+        in++;
+    }
+    
+    if(args->size == 0) /* no arguments, still argv must hold the NULL */
+    {
+        args->argv = (char**)malloc(ARGV_INITIAL_SIZE * sizeof(char*));
+        if(args->argv == NULL)
+        {
+            perror("error");
+            return -1;
+        }
+        args->size = ARGV_INITIAL_SIZE;
+    }
+    if(background != NULL)
+    {
+        *background = 0;
+        if(argc > 1 && literal == 0 && strcmp(args->argv[argc - 1], "&") == 0) /* running in background */
+        {
+            *background = 1;
+            argc--; /* removing '&' from the command */
+        }
+    }
+    args->argv[argc] = NULL; /* to make sure that the last cell in the array contains NULL */
+    return argc;
+}
+
+/* function that runs argv in a new process, when out_fd is not -1 the stdout and stderr of the
+child are redirected to it, returns the pid of the child or -1 if fork() has failed */
+pid_t spawn_command(char **argv, int out_fd)
+{
+    struct timespec started;
+    int exec_pipe[2]; /* closed by exec, so reading it returns when the child has called exec */
+    sigset_t mask;
+    char c;
+    int measure = (pipe2(exec_pipe, O_CLOEXEC) == 0);
+    pid_t pid;
+    
+    fflush(stdout); /* so the child does not inherit (and print again) the output of the builtins */
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    pid = fork(); /* new process */
+    if (pid == 0) /* child process */
+    {
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL); /* the signals that the server mode blocks or ignores */
+        signal(SIGPIPE, SIG_DFL);
+        if(measure)
+        {
+            close(exec_pipe[0]);
+        }
+        if(out_fd != -1)
+        {
+            dup2(out_fd, 1); /* redirecting stdout */
+            dup2(out_fd, 2); /* redirecting stderr */
+            close(out_fd);
+        }
+        execvp(argv[0], argv); /* executing the recieved command */
+        perror("error"); /* report an error */
+        _exit(EXIT_FAILURE); /* exit child process (without flushing the stdio buffers of the shell) */
+    }
+    if(measure)
+    {
+        close(exec_pipe[1]);
+        if(pid > 0)
+        {
+            while(read(exec_pipe[0], &c, 1) < 0 && errno == EINTR); /* waiting for exec (or exit) of the child */
+            histogram_add(&stats.spawn_latency, elapsed_us(&started));
+        }
+        close(exec_pipe[0]);
+    }
+    return pid;
+}
+
+/* returns the exit status of a command from its wait status (128 + the signal number for killed commands) */
+int exit_code(int status)
+{
+    if(WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+/* function that runs argv (builtins inside the shell, other commands in a new process) and waits for it unless background
+is not 0, the resources of the command are saved in usage and wall_us, returns the exit status of the command or -1 */
+int run_command(char **argv, int background, struct rusage *usage, long long *wall_us)
+{
+    struct timespec started;
+    struct rusage before;
+    int status;
+    pid_t pid;
+    const builtin_command *builtin = find_builtin(argv[0]);
+    
+    memset(usage, 0, sizeof(*usage));
+    *wall_us = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if(builtin != NULL) /* running the builtin inside the shell process */
+    {
+        getrusage(RUSAGE_SELF, &before);
+        status = builtin->func(argv);
+        getrusage(RUSAGE_SELF, usage);
+        /* the resources that the builtin used (max rss is the max rss of the shell) */
+        timersub(&usage->ru_utime, &before.ru_utime, &usage->ru_utime);
+        timersub(&usage->ru_stime, &before.ru_stime, &usage->ru_stime);
+        usage->ru_nvcsw -= before.ru_nvcsw;
+        usage->ru_nivcsw -= before.ru_nivcsw;
+        *wall_us = elapsed_us(&started);
+        return status; /* the statistics are kept only for the commands that were spawned */
+    }
+    
+    pid = spawn_command(argv, -1); /* new process */
+    if(pid < 0) /* fork() has failed */
+    {
+        perror("error");
+        return -1;
+    }
+    if(background == 1)
+    {
+        return 0;
+    }
+    if(wait4(pid, &status, 0, usage) < 0) /* waiting for child process to finish */
+    {
+        perror("error");
+        return -1;
+    }
+    *wall_us = elapsed_us(&started);
+    stats_record_command(*wall_us, usage);
+    return exit_code(status);
+}
+
+/* function that runs the builtin inside the shell with its stdout and stderr redirected to out_fd, returns its exit status */
+int run_builtin_redirected(const builtin_command *builtin, char **argv, int out_fd)
 {
-    close(2); /* closing stderr */
-    dup(1); /* directing errors to stdout */
-    char command[BUFFER_SIZE]; /* to save the recieved command */
-    char **history = (char**)malloc(sizeof(char*));
-    char **temp; /* to backup the history while reallocating */
-    int i = 0; /* to use in for loops */
-    int his_count = 0; /* history counter */
-    int his_size = 1; /* history size */
-    if(history == NULL)
+    int saved_stdout;
+    int status;
+    fflush(stdout);
+    saved_stdout = dup(1); /* stderr is a copy of stdout (see main) */
+    dup2(out_fd, 1);
+    dup2(out_fd, 2);
+    status = builtin->func(argv);
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+    dup2(saved_stdout, 2);
+    close(saved_stdout);
+    return status;
+}
+
+/* function that copies the output of a finished job to stdout and closes its temporary file */
+void print_job_output(batch_job *job)
+{
+    char buffer[BUFSIZ]; /* to copy the output in blocks */
+    size_t bytes;
+    
+    rewind(job->output); /* reading the output from its beginning */
+    while((bytes = fread(buffer, 1, sizeof(buffer), job->output)) > 0)
+    {
+        fwrite(buffer, 1, bytes, stdout);
+    }
+    fflush(stdout);
+    fclose(job->output);
+    job->output = NULL;
+}
+
+/* function that waits for one of the running jobs and marks it as done, returns the index of the job or -1 */
+int reap_job(batch_job *jobs, int jobs_count)
+{
+    struct rusage usage;
+    int status;
+    int i;
+    pid_t pid;
+    while((pid = wait4(-1, &status, 0, &usage)) > 0) /* waiting for any child process to finish */
+    {
+        for(i = 0; i < jobs_count; i++)
         {
-            perror("error");
-            return 0;
+            if(jobs[i].pid == pid && jobs[i].done == 0)
+            {
+                jobs[i].status = status;
+                jobs[i].done = 1;
+                stats_record_command(elapsed_us(&jobs[i].started), &usage);
+                return i;
+            }
         }
-        
-    while (1)
+    }
+    return -1;
+}
+
+/* function that waits till at most max_running jobs are still running, returns 1 if one of the finished jobs has failed */
+int wait_jobs(batch_job *jobs, int jobs_count, int *running, int max_running)
+{
+    int failed = 0;
+    int i;
+    while(*running > max_running)
     {
-        fprintf(stdout, "my-shell> ");
-        memset(command, 0, BUFFER_SIZE); /* filling all the cells with '\0' */
-        fgets(command, BUFFER_SIZE, stdin); /* getting the input and saving it to command */
-        if(strncmp(command, "exit", 4) == 0) /* checking if the user insert exit */
+        i = reap_job(jobs, jobs_count);
+        if(i == -1)
         {
             break;
         }
-        
-        if (command[strlen(command) - 1] == '\n') /* removing the enter char if exists */
+        (*running)--;
+        if(!WIFEXITED(jobs[i].status) || WEXITSTATUS(jobs[i].status) != 0)
+        {
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+/* function that prints the output of the finished lines whose turn has come, jobs is a ring of window entries
+and line n is in jobs[n % window] */
+void print_ready_jobs(batch_job *jobs, int window, int *printed, int jobs_count)
+{
+    while(*printed < jobs_count && jobs[*printed % window].done == 1)
+    {
+        print_job_output(&jobs[(*printed)++ % window]);
+    }
+}
+
+/* function that runs the lines of the received script with at most max_jobs children at the same time,
+the output of every line is printed in the order of the lines, when stop_on_error is not 0 no new
+lines are started after a line has failed, returns 0 if all the lines succeeded and 1 otherwise.
+at most max_jobs * BATCH_WINDOW_FACTOR lines are started and not printed yet (each of them holds an open
+output file), a slow line stops new lines from starting once the lines after it fill the window.
+builtins run inside the shell in their turn to start and their output is kept like the output of a child,
+only the builtins that change the directory or environment wait for all the previous lines to finish */
+int run_batch(const char *path, int max_jobs, int stop_on_error)
+{
+    char *line = NULL; /* to save the current line (getline grows it as needed) */
+    size_t line_size = 0; /* size of line */
+    ssize_t length; /* length of the current line */
+    arg_vector args = {NULL, 0}; /* array to send to execvp function as a parameter*/
+    char **argv;
+    int window = max_jobs * BATCH_WINDOW_FACTOR; /* lines that may be started and not printed */
+    batch_job *jobs = (batch_job*)calloc(window, sizeof(batch_job)); /* the lines that are not printed, line n is in jobs[n % window] */
+    batch_job *job;
+    int jobs_count = 0; /* number of started lines */
+    int running = 0; /* number of children that are still running */
+    int printed = 0; /* index of the next line to print */
+    int failed = 0; /* failure indicator */
+    const builtin_command *builtin;
+    FILE *script = fopen(path, "r");
+    if(script == NULL || jobs == NULL)
+    {
+        perror("error");
+        if(script != NULL)
+        {
+            fclose(script);
+        }
+        free(jobs);
+        return 1;
+    }
+    
+    while (failed == 0 || stop_on_error == 0)
+    {
+        length = getline(&line, &line_size, script);
+        if(length < 0) /* end of the script */
+        {
+            break;
+        }
+        if (length > 0 && line[length - 1] == '\n') /* removing the enter char if exists */
+        {
+            line[length - 1] = '\0';
+        }
+        if(line[0] == '#' || parse_command(line, &args, NULL) <= 0) /* skipping comments, empty lines and lines that are not valid */
         {
-            command[strlen(command) - 1] = '\0'; /* replacing '\n' with \0'*/
+            continue;
         }
+        argv = args.argv;
         
-        if(his_count == his_size)
+        builtin = find_builtin(argv[0]);
+        if(builtin != NULL && builtin->shared_state) /* the previous lines must finish before the shell itself changes */
         {
-            his_size = his_size*2; /* making the history larger by 1 */
-            temp = (char**)realloc(history, his_size * sizeof(char *));
-            if(temp == NULL)
+            failed |= wait_jobs(jobs, window, &running, 0);
+            print_ready_jobs(jobs, window, &printed, jobs_count);
+            if(failed == 1 && stop_on_error == 1)
             {
-                /* Free the allocated memory before exiting */
-                for (i = 0; i < his_count; i++)
-                {
-                    free(history[i]);
-                }
-                free(history);
-                perror("error");
-                return 0;
+                break;
+            }
+            if(builtin->func(argv) != 0)
+            {
+                failed = 1;
             }
-            history = temp; /* history will point again (the memory allocation succeeded) */
+            fflush(stdout);
+            continue;
+        }
+        
+        if(builtin == NULL)
+        {
+            failed |= wait_jobs(jobs, window, &running, max_jobs - 1); /* waiting for a free slot */
+        }
+        print_ready_jobs(jobs, window, &printed, jobs_count);
+        while(jobs_count - printed >= window && running > 0) /* the window is full, waiting for its oldest line */
+        {
+            failed |= wait_jobs(jobs, window, &running, running - 1);
+            print_ready_jobs(jobs, window, &printed, jobs_count);
+        }
+        if(failed == 1 && stop_on_error == 1) /* a line has failed while waiting */
+        {
+            break;
         }
         
-        history[his_count] = (char*)malloc(strlen(command)+1); /* allocating memory for the recieved command to store in history */
-        if(history[his_count] == NULL)
+        job = &jobs[jobs_count % window]; /* the entry of a line that was printed */
+        job->output = tmpfile(); /* the output of the line is kept till its turn to be printed */
+        if(job->output == NULL)
+        {
+            perror("error");
+            failed = 1;
+            break;
+        }
+        if(builtin != NULL) /* done as soon as it returns, no slot of a child is taken */
         {
-            /* Free the allocated memory before exiting */
-            for (i = 0; i < his_count; i++)
+            job->pid = 0;
+            job->status = W_EXITCODE(run_builtin_redirected(builtin, argv, fileno(job->output)) & 0xff, 0);
+            job->done = 1;
+            jobs_count++;
+            if(!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0)
             {
-                free(history[i]);
+                failed = 1;
             }
-            free(history);
+            print_ready_jobs(jobs, window, &printed, jobs_count);
+            continue;
+        }
+        fflush(stdout); /* so the child will not inherit buffered output */
+        clock_gettime(CLOCK_MONOTONIC, &job->started);
+        job->pid = spawn_command(argv, fileno(job->output));
+        job->done = 0;
+        if(job->pid < 0) /* fork() has failed */
+        {
             perror("error");
-            return 0;
+            fclose(job->output);
+            job->output = NULL;
+            failed = 1;
+            break;
         }
-        strcpy(history[his_count], command); /* copying the received command to the history */
-        his_count ++;
+        jobs_count++;
+        running++;
         
-        if(strncmp(command, "history", 7) == 0) /* checking if the command's prefix is history */
+        print_ready_jobs(jobs, window, &printed, jobs_count); /* printing the lines that their turn has come */
+    }
+    
+    failed |= wait_jobs(jobs, window, &running, 0); /* waiting for the lines that are still running */
+    print_ready_jobs(jobs, window, &printed, jobs_count); /* printing the rest of the output in order */
+    
+    fclose(script);
+    free(line);
+    free(args.argv);
+    free(jobs);
+    return failed;
+}
+
+/* one connection of the server mode, its commands run one after the other, the output of the children goes directly to the socket
+and the output of the builtins and the result lines are queued in output, the next line runs only after output was sent */
+typedef struct {
+    int fd; /* the client socket (-1 for a free entry) */
+    char *buffer; /* the received bytes that were not executed yet */
+    int size; /* size of buffer */
+    int length; /* number of bytes in buffer */
+    char *output; /* the bytes that were not sent to the client yet */
+    int output_size; /* size of output */
+    int output_length; /* number of bytes in output */
+    pid_t pid; /* the running command of the client (0 when there is none) */
+    int timed; /* the running command was started by time, its resources are sent in its result line */
+    struct timespec started; /* when the running command was started */
+} server_client;
+
+server_client *clients = NULL; /* the clients by their socket */
+int clients_size = 0; /* size of the clients array */
+int epoll_fd = -1;
+int server_output_fd = -1; /* memory file that keeps the output of a builtin till it is queued */
+arg_vector server_args = {NULL, 0}; /* the argv of the command that is started */
+
+/* returns the client of the received socket, the clients array grows as needed, returns NULL if the allocation has failed */
+server_client *server_get_client(int fd)
+{
+    server_client *temp;
+    int i;
+    if(fd >= clients_size)
+    {
+        temp = (server_client*)realloc(clients, (fd + 1) * 2 * sizeof(server_client));
+        if(temp == NULL)
+        {
+            return NULL;
+        }
+        clients = temp;
+        for(i = clients_size; i < (fd + 1) * 2; i++)
+        {
+            clients[i].fd = -1;
+            clients[i].buffer = NULL;
+            clients[i].size = 0;
+            clients[i].output = NULL;
+            clients[i].output_size = 0;
+        }
+        clients_size = (fd + 1) * 2;
+    }
+    return &clients[fd];
+}
+
+/* disconnecting the received client */
+void server_close_client(server_client *client)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    free(client->buffer);
+    client->buffer = NULL;
+    client->size = 0;
+    free(client->output);
+    client->output = NULL;
+    client->output_size = 0;
+}
+
+/* function that makes room for length more bytes at the end of the output of the client,
+returns where they should be written or NULL if the allocation has failed */
+char *server_reserve(server_client *client, int length)
+{
+    char *temp;
+    int size = (client->output_size == 0) ? SERVER_BUFFER_SIZE : client->output_size;
+    while(size - client->output_length < length)
+    {
+        size *= 2;
+    }
+    if(size != client->output_size)
+    {
+        temp = (char*)realloc(client->output, size);
+        if(temp == NULL)
+        {
+            return NULL;
+        }
+        client->output = temp;
+        client->output_size = size;
+    }
+    return client->output + client->output_length;
+}
+
+/* function that sends the queued output of the client as far as the socket takes it without blocking, returns -1 if the client should be closed */
+int server_flush(server_client *client)
+{
+    ssize_t bytes;
+    int sent = 0;
+    while(sent < client->output_length)
+    {
+        bytes = send(client->fd, client->output + sent, client->output_length - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(bytes < 0)
         {
-            for(i = (his_count-1) ; i >= 0 ; i--)
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
             {
-                fprintf(stdout, "%d %s\n",i+1 , history[i]);
+                return -1;
             }
-            continue; /* go to next  command */
+            break; /* the rest is sent when the socket is writable */
         }
-        
-        int background = 0; /* background executing indicator */
-        if ((strlen(command) >= 2) && command[strlen(command)-1] == '&' && command[strlen(command)-2] == ' ')
+        sent += bytes;
+    }
+    client->output_length -= sent;
+    memmove(client->output, client->output + sent, client->output_length);
+    return 0;
+}
+
+/* function that queues the received bytes to the client and sends what it can, returns -1 if the client should be closed */
+int server_queue(server_client *client, const char *data, int length)
+{
+    char *out = server_reserve(client, length);
+    if(out == NULL)
+    {
+        return -1;
+    }
+    memcpy(out, data, length);
+    client->output_length += length;
+    return server_flush(client);
+}
+
+/* function that runs the builtin inside the server and queues its output to the client, returns its exit status */
+int server_run_builtin(server_client *client, const builtin_command *builtin, char **argv)
+{
+    char *out;
+    off_t length;
+    int status;
+    ftruncate(server_output_fd, 0);
+    lseek(server_output_fd, 0, SEEK_SET);
+    status = run_builtin_redirected(builtin, argv, server_output_fd);
+    length = lseek(server_output_fd, 0, SEEK_CUR);
+    if(length > 0 && length <= INT_MAX && (out = server_reserve(client, length)) != NULL &&
+       pread(server_output_fd, out, length, 0) == length)
+    {
+        client->output_length += length;
+    }
+    return status;
+}
+
+/* sending the exit status and the wall time of the command that finished to its client, with its resources when it was run by time,
+returns -1 if the client should be closed */
+int server_send_result(server_client *client, int status, long long wall_us, const struct rusage *usage)
+{
+    char result[320];
+    char report[256];
+    int length;
+    if(usage != NULL) /* the command was run by time */
+    {
+        format_usage(report, sizeof(report), wall_us, usage);
+        length = snprintf(result, sizeof(result), "[exit %d %lld us %s]\n", status, wall_us, report);
+    }
+    else
+    {
+        length = snprintf(result, sizeof(result), "[exit %d %lld us]\n", status, wall_us);
+    }
+    return server_queue(client, result, length);
+}
+
+/* running the complete lines that the client has sent till one of them starts a child process,
+builtins run inside the server with their output queued to the client, except:
+time of a command, which is spawned like any command and reported by server_reap so it does not block the server,
+and the builtins that change the directory or environment, which are refused because all the clients share them.
+returns -1 if the client should be closed */
+int server_run_lines(server_client *client)
+{
+    char **argv;
+    char *newline;
+    const builtin_command *builtin;
+    const builtin_command *target; /* the builtin that runs, for time it is the timed builtin */
+    struct epoll_event event;
+    char message[128];
+    int status;
+    
+    while(client->pid == 0 && client->output_length == 0 && (newline = memchr(client->buffer, '\n', client->length)) != NULL)
+    {
+        *newline = '\0';
+        if(newline > client->buffer && newline[-1] == '\r')
         {
-            background = 1; /* executing in background */
-            command[strlen(command) - 1] = '\0'; /* removing '&' from the command */
+            newline[-1] = '\0';
         }
-        else
+        if(strncmp(client->buffer, "exit", 4) == 0)
         {
-            background = 0; /* without '&' the command will execute in foreground */
+            return -1;
         }
-        
-        pid_t pid = fork(); /* new process */
-        if (pid == 0) /* child process */ 
+        if(client->buffer[0] != '\0')
         {
-            char *argv[BUFFER_SIZE]; /* array to send to execvp function as a parameter*/
-            int argc = 0; /* agrv index */
-            char *token = strtok(command, " "); /* take the token from command */
-            
-            while (token != NULL) /* tokenize till NULL */
+            history_add(client->buffer); /* the server shares one history with all its clients */
+            history_save(client->buffer);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &client->started);
+        if(parse_command(client->buffer, &server_args, NULL) > 0)
+        {
+            argv = server_args.argv;
+            builtin = find_builtin(argv[0]);
+            while(builtin != NULL && builtin->func == builtin_time && argv[1] != NULL && strcmp(argv[1], builtin->name) == 0)
             {
-                argv[argc++] = token;
-                token = strtok(NULL, " ");
+                argv++; /* time time is timed once, the inner time would block the server */
+            }
+            if(builtin != NULL && builtin->func == builtin_time && argv[1] != NULL && find_builtin(argv[1]) == NULL)
+            {
+                argv++; /* time of a command, running the command */
+                builtin = NULL;
+                client->timed = 1;
+            }
+            target = (builtin != NULL && builtin->func == builtin_time && argv[1] != NULL) ? find_builtin(argv[1]) : builtin;
+            if(target != NULL && target->shared_state) /* would change the shell of all the clients */
+            {
+                status = snprintf(message, sizeof(message), "error: %s is not available in server mode\n", target->name);
+                if(server_queue(client, message, status) < 0 || server_send_result(client, 1, 0, NULL) < 0)
+                {
+                    return -1;
+                }
+            }
+            else if(builtin != NULL) /* running the builtin with its output queued to the client */
+            {
+                status = server_run_builtin(client, builtin, argv);
+                if(server_send_result(client, status, elapsed_us(&client->started), NULL) < 0)
+                {
+                    return -1;
+                }
+            }
+            else
+            {
+                client->pid = spawn_command(argv, client->fd);
+                if(client->pid < 0)
+                {
+                    client->pid = 0;
+                    client->timed = 0;
+                    if(server_send_result(client, -1, 0, NULL) < 0)
+                    {
+                        return -1;
+                    }
+                }
             }
-        argv[argc] = NULL; /* to make sure that the last cell in the array contains NULL */
-        execvp(argv[0],argv); /* executing the recieved command */
-        perror("error"); /* report an error */
-        exit(EXIT_FAILURE); /* exit child process */
         }
-        else if (pid > 0) /* father process */
+        
+        client->length -= newline + 1 - client->buffer; /* removing the line from the buffer */
+        memmove(client->buffer, newline + 1, client->length);
+    }
+    
+    /* reading the next lines of the client only when it has no running command and all its output was sent */
+    event.events = (client->pid == 0 && client->output_length == 0) ? EPOLLIN : 0;
+    if(client->output_length > 0)
+    {
+        event.events |= EPOLLOUT;
+    }
+    event.data.fd = client->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    return 0;
+}
+
+/* reaping the finished commands and sending their results to their clients */
+void server_reap(void)
+{
+    struct rusage usage;
+    long long wall_us;
+    int status;
+    int i;
+    pid_t pid;
+    while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+    {
+        for(i = 0; i < clients_size; i++)
         {
-            if(background == 0)
+            if(clients[i].fd != -1 && clients[i].pid == pid)
             {
-                waitpid(pid, NULL, 0); /* waiting for child process to finish */
+                wall_us = elapsed_us(&clients[i].started);
+                stats_record_command(wall_us, &usage);
+                clients[i].pid = 0;
+                status = server_send_result(&clients[i], exit_code(status), wall_us, clients[i].timed ? &usage : NULL);
+                clients[i].timed = 0;
+                if(status < 0 || server_run_lines(&clients[i]) < 0)
+                {
+                    server_close_client(&clients[i]);
+                }
+                break;
             }
         }
-        else /* pid = -1 (fork() has failed) */
+    }
+}
+
+/* function that serves clients on the received unix socket path, every client sends command lines and receives
+their output followed by a "[exit status time us]" line, the commands run through the same path as the interactive commands,
+SIGTERM and SIGINT stop the server, returns 0 after such a stop and 1 if the server has failed */
+int run_server(const char *path)
+{
+    struct sockaddr_un address;
+    struct stat st;
+    struct epoll_event event;
+    struct epoll_event events[SERVER_EVENTS];
+    struct signalfd_siginfo info;
+    server_client *client;
+    char *temp;
+    sigset_t mask;
+    ssize_t bytes;
+    int listen_fd;
+    int signal_fd;
+    int fd;
+    int count;
+    int stopped = 0; /* 1 after SIGTERM or SIGINT */
+    int i;
+    
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stdout, "error: socket path is too long\n");
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL); /* the finished children and the stop requests are reported by the signalfd */
+    signal(SIGPIPE, SIG_IGN); /* a client that disconnects must not kill the server */
+    
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server_output_fd = memfd_create("myshell-output", MFD_CLOEXEC);
+    if(listen_fd < 0 || signal_fd < 0 || epoll_fd < 0 || server_output_fd < 0)
+    {
+        perror("error");
+        return 1;
+    }
+    if(lstat(path, &st) == 0) /* removing a socket that was left by a previous server, but no other file */
+    {
+        if(!S_ISSOCK(st.st_mode))
+        {
+            fprintf(stdout, "error: %s exists and is not a socket\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+    if(bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0)
+    {
+        perror("error");
+        return 1;
+    }
+    
+    event.events = EPOLLIN;
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.fd = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+    
+    while(stopped == 0)
+    {
+        count = epoll_wait(epoll_fd, events, SERVER_EVENTS, -1);
+        if(count < 0)
         {
+            if(errno == EINTR)
+            {
+                continue;
+            }
             perror("error");
+            break;
+        }
+        for(i = 0; i < count; i++)
+        {
+            fd = events[i].data.fd;
+            if(fd == listen_fd) /* new client */
+            {
+                fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if(fd < 0)
+                {
+                    continue;
+                }
+                client = server_get_client(fd);
+                if(client == NULL)
+                {
+                    close(fd);
+                    continue;
+                }
+                client->fd = fd;
+                client->length = 0;
+                client->output_length = 0;
+                client->pid = 0;
+                client->timed = 0;
+                event.events = EPOLLIN;
+                event.data.fd = fd;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            }
+            else if(fd == signal_fd) /* some children have finished or the server should stop */
+            {
+                while(read(signal_fd, &info, sizeof(info)) == sizeof(info))
+                {
+                    if(info.ssi_signo == SIGTERM || info.ssi_signo == SIGINT)
+                    {
+                        stopped = 1; /* after the rest of the events */
+                    }
+                }
+                server_reap();
+            }
+            else if(events[i].events & EPOLLOUT) /* the client can take more of its queued output */
+            {
+                client = &clients[fd];
+                if(server_flush(client) < 0 || server_run_lines(client) < 0)
+                {
+                    server_close_client(client);
+                }
+            }
+            else /* new lines from a client */
+            {
+                client = &clients[fd];
+                if(client->length == client->size) /* making the buffer larger for long lines */
+                {
+                    temp = (char*)realloc(client->buffer, (client->size == 0) ? SERVER_BUFFER_SIZE : client->size * 2);
+                    if(temp == NULL)
+                    {
+                        server_close_client(client);
+                        continue;
+                    }
+                    client->buffer = temp;
+                    client->size = (client->size == 0) ? SERVER_BUFFER_SIZE : client->size * 2;
+                }
+                bytes = recv(fd, client->buffer + client->length, client->size - client->length, MSG_DONTWAIT);
+                if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                {
+                    continue;
+                }
+                if(bytes <= 0)
+                {
+                    server_close_client(client);
+                    continue;
+                }
+                client->length += bytes;
+                if(server_run_lines(client) < 0)
+                {
+                    server_close_client(client);
+                }
+            }
+        }
+    }
+    
+    close(listen_fd);
+    close(signal_fd);
+    close(epoll_fd);
+    close(server_output_fd);
+    unlink(path);
+    history_flush(); /* writing the commands that are still pending */
+    return stopped ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    const char *script = NULL; /* the script file of the batch mode */
+    const char *socket_path = NULL; /* the socket of the server mode */
+    int max_jobs = 1; /* max number of lines that run at the same time in batch mode */
+    int stop_on_error = 0; /* stop starting new lines after a failure in batch mode */
+    
+    while((opt = getopt(argc, argv, "f:j:es:")) != -1) /* reading the command line options */
+    {
+        switch(opt)
+        {
+            case 'f':
+                script = optarg;
+            break;
+            case 'j':
+                max_jobs = atoi(optarg);
+            break;
+            case 'e':
+                stop_on_error = 1;
+            break;
+            case 's':
+                socket_path = optarg;
+            break;
+            default:
+                fprintf(stderr, "usage: %s [-f script [-j jobs] [-e] | -s socket]\n", argv[0]);
+                return 1;
         }
     }
+    if(max_jobs < 1)
+    {
+        max_jobs = 1;
+    }
+    
+    close(2); /* closing stderr */
+    dup(1); /* directing errors to stdout */
+    if(script != NULL) /* batch mode */
+    {
+        return run_batch(script, max_jobs, stop_on_error);
+    }
+    if(socket_path != NULL) /* server mode */
+    {
+        history_load();
+        return run_server(socket_path);
+    }
     
-    /* Free the allocated memory before exiting */
-    for (i = 0; i < his_count; i++)
+    char *command = NULL; /* to save the recieved command (getline grows it as needed) */
+    size_t command_size = 0; /* size of command */
+    ssize_t length; /* length of the recieved command */
+    arg_vector args = {NULL, 0}; /* array to send to execvp function as a parameter*/
+    int argc_count; /* number of arguments of the command */
+    int background; /* background executing indicator */
+    char *temp;
+    const char *expanded; /* the history command that "!" refers to */
+    struct rusage usage; /* resources of the last command */
+    long long wall_us; /* wall time of the last command */
+    
+    history_load(); /* the history of the previous sessions */
+    while (1)
     {
-        free(history[i]);
+        fprintf(stdout, "my-shell> ");
+        length = getline(&command, &command_size, stdin); /* getting the input and saving it to command */
+        if(length < 0) /* stopping at the end of the input */
+        {
+            break;
+        }
+        if(strncmp(command, "exit", 4) == 0) /* checking if the user insert exit */
+        {
+            break;
+        }
+        
+        if (length > 0 && command[length - 1] == '\n') /* removing the enter char if exists */
+        {
+            command[--length] = '\0'; /* replacing '\n' with \0'*/
+        }
+        
+        if(command[0] == '!') /* running a command from the history */
+        {
+            expanded = history_expand(command);
+            if(expanded == NULL)
+            {
+                fprintf(stdout, "error: %s: event not found\n", command);
+                continue;
+            }
+            length = strlen(expanded);
+            if((size_t)length + 1 > command_size) /* making command large enough for the history command */
+            {
+                temp = (char*)realloc(command, length + 1);
+                if(temp == NULL)
+                {
+                    perror("error");
+                    continue;
+                }
+                command = temp;
+                command_size = length + 1;
+            }
+            memcpy(command, expanded, length + 1);
+            fprintf(stdout, "%s\n", command);
+        }
+        if(command[0] != '\0')
+        {
+            history_add(command); /* saving the command in the history */
+            history_save(command); /* and in the history file */
+        }
+        
+        argc_count = parse_command(command, &args, &background); /* without an unquoted '&' the command will execute in foreground */
+        if(argc_count <= 0) /* nothing to execute */
+        {
+            continue;
+        }
+        
+        run_command(args.argv, background, &usage, &wall_us);
     }
-    free(history);
     
+    free(command);
+    free(args.argv);
+    history_flush(); /* writing the commands that are still pending */
     return 0;
 }
 